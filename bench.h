@@ -0,0 +1,28 @@
+#ifndef MAT_BENCH_H
+#define MAT_BENCH_H
+
+// Hot path markers for bench/simbench. The selected path raises BENCH_BIT
+// while it runs, the simulator counts the cycles in between.
+
+#define BENCH_FLASH_WR 1
+#define BENCH_FLASH_VRF 2
+#define BENCH_EE24_RD 3
+#define BENCH_EE24_CRC 4
+#define BENCH_AT_CHAR 5
+#define BENCH_AT_CMD 6
+
+#ifdef BENCH
+	#include <inttypes.h>
+	#include <avr/io.h>
+	#include "hwdefs.h"
+
+	extern uint8_t bench_sel;
+
+	#define BENCH_BEGIN(n) do { if( bench_sel == (n) ) BENCH_PORT |= _BV(BENCH_BIT); } while( 0 )
+	#define BENCH_END(n) do { if( bench_sel == (n) ) BENCH_PORT &= ~_BV(BENCH_BIT); } while( 0 )
+#else
+	#define BENCH_BEGIN(n) do { } while( 0 )
+	#define BENCH_END(n) do { } while( 0 )
+#endif
+
+#endif
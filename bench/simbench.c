@@ -0,0 +1,494 @@
+/**
+AVR isp bub - cycle benchmark
+
+@file		simbench.c
+@brief		Runs the firmware on simavr and counts cycles spent in hot paths
+@note		The firmware must be built with -DBENCH -DISP_DEBUG_COMMANDS.
+			AT+BENCH=n selects a path, which then raises BENCH_BIT for
+			as long as it runs (see bench.h). The target AVR and the
+			24C512 are the behavioural models from host/, clocked by the
+			simulated cycle counter.
+
+			simbench [-w] [-t pct] main.elf f_cpu baseline.txt
+
+			Without -w the results are compared to the baseline and the
+			exit code is 1 when any path got slower by more than pct
+			percent (default 2). With -w, or when there is no baseline
+			yet, the baseline is (re)written.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_ioport.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+#include "avr_uart.h"
+
+#include "sim_ee24.h"
+#include "sim_tgt.h"
+
+// must match bench.h and hwdefs.h
+#define BENCH_FLASH_WR 1
+#define BENCH_FLASH_VRF 2
+#define BENCH_EE24_RD 3
+#define BENCH_EE24_CRC 4
+#define BENCH_AT_CHAR 5
+#define BENCH_AT_CMD 6
+
+#define BENCH_PORT 'D'
+#define BENCH_BIT 7
+#define TRST_PORT 'D'
+#define TRST_BIT 5
+#define BTN_PORT 'C'
+#define BTN_BIT 0
+
+#define EE24_I2C_ADR 0xa0
+
+#define TGT_PART "atmega8"
+#define TGT_TARGET "AT+ISPTARGET=1e9307,64,1024,-,-,-,-,0"
+#define TGT_PGSIZE 64
+#define IMG_SIZE 1024
+
+#define CMD_TIMEOUT_S 30
+
+// ----------------------------------------------------------------------------
+
+static avr_t* avr;
+
+static uint8_t ee24_mem[SIM_EE24_SIZE];
+static uint8_t tgt_flash[SIM_TGT_FLASH_MAX];
+static uint8_t tgt_ee[SIM_TGT_EE_MAX];
+static uint8_t tgt_fuse[SIM_TGT_FUSES];
+
+static uint64_t now_us(void)
+{
+	return avr->cycle * 1000000ULL / avr->frequency;
+}
+
+// --- bench marker ---
+
+static uint8_t mark_on;
+static avr_cycle_count_t mark_start;
+static uint64_t mark_cycles;
+static uint32_t mark_calls;
+
+static void mark_pin(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	if( value && !mark_on ) {
+		mark_start = avr->cycle;
+		mark_on = 1;
+	} else
+	if( !value && mark_on ) {
+		mark_cycles += avr->cycle - mark_start;
+		mark_calls++;
+		mark_on = 0;
+	}
+}
+
+// --- ISP ---
+
+static avr_irq_t* spi_in;
+
+static void trst_pin(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	sim_tgt_reset(now_us(), value == 0);
+}
+
+static void spi_out(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	avr_raise_irq(spi_in, sim_tgt_spi(now_us(), value));
+}
+
+// --- 24C512 on TWI ---
+
+static avr_irq_t* twi_in;
+static uint8_t twi_sel;
+static uint8_t twi_wbuf[2 + SIM_EE24_PAGE];
+static uint16_t twi_wlen;
+
+static void twi_flush(void)
+{
+	if( twi_wlen ) sim_ee24_wr(now_us(), twi_wbuf, twi_wlen);
+	twi_wlen = 0;
+}
+
+static void twi_out(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	avr_twi_msg_irq_t v;
+	v.u.v = value;
+
+	if( v.u.twi.msg & TWI_COND_STOP ) {
+		twi_flush();
+		twi_sel = 0;
+	}
+
+	if( v.u.twi.msg & TWI_COND_START ) {
+		twi_flush();
+		twi_sel = 0;
+		if( ((v.u.twi.addr & ~1) == EE24_I2C_ADR) && !sim_ee24_busy(now_us()) ) {
+			twi_sel = v.u.twi.addr;
+			avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_ACK, twi_sel, 1));
+		}
+	}
+
+	if( twi_sel == 0 ) return;
+
+	if( v.u.twi.msg & TWI_COND_WRITE ) {
+		avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_ACK, twi_sel, 1));
+		if( twi_wlen < sizeof(twi_wbuf) ) twi_wbuf[twi_wlen++] = v.u.twi.data;
+	}
+
+	if( v.u.twi.msg & TWI_COND_READ ) {
+		uint8_t d;
+		sim_ee24_rd(now_us(), &d, 1);
+		avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_READ, twi_sel, d));
+	}
+}
+
+// --- UART ---
+
+static avr_irq_t* uart_in;
+static uint8_t uart_xon = 1;
+static char tx_q[1024];
+static uint16_t tx_head, tx_tail;
+static char rx_line[256];
+static uint16_t rx_len;
+static char last_line[256];
+static uint8_t line_ready;
+
+static void uart_out(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	if( value == '\r' ) return;
+	if( value == '\n' ) {
+		rx_line[rx_len] = 0;
+		strcpy(last_line, rx_line);
+		rx_len = 0;
+		line_ready = 1;
+		return;
+	}
+	if( rx_len < sizeof(rx_line) - 1 ) rx_line[rx_len++] = value;
+}
+
+static void uart_xon_cb(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	uart_xon = 1;
+}
+
+static void uart_xoff_cb(struct avr_irq_t* irq, uint32_t value, void* param)
+{
+	uart_xon = 0;
+}
+
+static void uart_send(const char* s)
+{
+	while( *s ) {
+		tx_q[tx_head++] = *s++;
+		tx_head %= sizeof(tx_q);
+	}
+}
+
+// runs the simulation until a line arrives, returns it
+static const char* run_line(void)
+{
+	avr_cycle_count_t limit = avr->cycle + (avr_cycle_count_t)CMD_TIMEOUT_S * avr->frequency;
+
+	line_ready = 0;
+	while( !line_ready ) {
+		if( uart_xon && (tx_tail != tx_head) ) {
+			avr_raise_irq(uart_in, (uint8_t)tx_q[tx_tail++]);
+			tx_tail %= sizeof(tx_q);
+		}
+		int st = avr_run(avr);
+		if( (st == cpu_Done) || (st == cpu_Crashed) ) {
+			fprintf(stderr, "simbench: cpu stopped\n");
+			exit(2);
+		}
+		if( avr->cycle > limit ) {
+			fprintf(stderr, "simbench: timeout\n");
+			exit(2);
+		}
+	}
+
+	return last_line;
+}
+
+// sends an AT command and waits for its OK
+static void at(const char* cmd)
+{
+	uart_send(cmd);
+	uart_send("\r");
+
+	while( 1 ) {
+		const char* l = run_line();
+		if( 0 == strcmp(l, "OK") ) return;
+		if( 0 == strncmp(l, "ERR", 3) ) {
+			fprintf(stderr, "simbench: %s: %s\n", cmd, l);
+			exit(2);
+		}
+	}
+}
+
+// sends AT+BUFWR with n bytes of the test pattern
+static void at_bufwr(uint16_t ofs, uint16_t n)
+{
+	char s[16 + 2*256];
+	strcpy(s, "AT+BUFWR=");
+	char* p = s + strlen(s);
+	while( n-- ) {
+		p += sprintf(p, "%02X", ee24_mem[ofs++]);
+	}
+	at(s);
+}
+
+// --- scenarios ---
+
+static void sc_flash_wr(void)
+{
+	at("AT+ISPCON");
+	at("AT+ISPERASE");
+	uint16_t a;
+	for( a = 0; a < IMG_SIZE; a += TGT_PGSIZE ) {
+		char s[32];
+		at_bufwr(a, TGT_PGSIZE);
+		sprintf(s, "AT+ISPFLSWR=%06X", a);
+		at(s);
+	}
+	at("AT+ISPDIS");
+}
+
+static void sc_flash_vrf(void)
+{
+	at("AT+ISPPROGRAM");
+	while( 1 ) { // result code line ends the run
+		const char* l = run_line();
+		if( (strlen(l) > 0) && (strlen(l) <= 2) && (strspn(l, "0123456789") == strlen(l)) ) {
+			if( atoi(l) ) {
+				fprintf(stderr, "simbench: programming failed (%s)\n", l);
+				exit(2);
+			}
+			break;
+		}
+	}
+}
+
+static void sc_ee24_rd(void)
+{
+	at("AT+BUFRDDISP=0");
+	uint16_t a;
+	for( a = 0; a < IMG_SIZE; a += 128 ) {
+		char s[32];
+		sprintf(s, "AT+EE24RD=%06X,128", a);
+		at(s);
+	}
+	at("AT+BUFRDDISP=1");
+}
+
+static void sc_ee24_crc(void)
+{
+	char s[32];
+	sprintf(s, "AT+EE24CRC=%u", IMG_SIZE);
+	at(s);
+}
+
+static void sc_at_char(void)
+{
+	at_bufwr(0, 128);
+	at_bufwr(128, 128);
+}
+
+static void sc_at_cmd(void)
+{
+	uint8_t i;
+	for( i = 0; i < 8; ++i ) {
+		uart_send("AT+NOSUCHCMD\r");
+		const char* l = run_line();
+		if( strcmp(l, "ERR") ) { fprintf(stderr, "simbench: unexpected %s\n", l); exit(2); }
+	}
+}
+
+struct bench_t {
+	uint8_t id;
+	const char* name;
+	void (*run)(void);
+	uint16_t bytes; // bytes handled per marked call, 0 if not meaningful
+	uint32_t cpc;   // cycles per call
+	uint32_t cpb;   // cycles per byte
+};
+
+static struct bench_t benches[] = {
+	{ BENCH_FLASH_WR,  "isp_flash_wr",  sc_flash_wr,  TGT_PGSIZE },
+	{ BENCH_FLASH_VRF, "isp_flash_vrf", sc_flash_vrf, TGT_PGSIZE },
+	{ BENCH_EE24_RD,   "ee24_rd",       sc_ee24_rd,   128 },
+	{ BENCH_EE24_CRC,  "ee24_crc",      sc_ee24_crc,  IMG_SIZE },
+	{ BENCH_AT_CHAR,   "at_char",       sc_at_char,   1 },
+	{ BENCH_AT_CMD,    "proc_at_cmd",   sc_at_cmd,    0 },
+};
+
+#define NBENCH (sizeof(benches)/sizeof(benches[0]))
+
+// ----------------------------------------------------------------------------
+
+static void sim_start(const char* elf, uint32_t fcpu)
+{
+	elf_firmware_t f;
+	memset(&f, 0, sizeof(f));
+
+	if( elf_read_firmware(elf, &f) ) {
+		fprintf(stderr, "simbench: cannot read %s\n", elf);
+		exit(2);
+	}
+	if( f.mmcu[0] == 0 ) strcpy(f.mmcu, "atmega8");
+	f.frequency = fcpu;
+
+	avr = avr_make_mcu_by_name(f.mmcu);
+	if( !avr ) {
+		fprintf(stderr, "simbench: unknown mcu %s\n", f.mmcu);
+		exit(2);
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(BENCH_PORT), BENCH_BIT), mark_pin, 0);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(TRST_PORT), TRST_BIT), trst_pin, 0);
+
+	// button released
+	avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(BTN_PORT), BTN_BIT), 1);
+
+	spi_in = avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), spi_out, 0);
+
+	twi_in = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT), twi_out, 0);
+
+	uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_out, 0);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uart_xon_cb, 0);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uart_xoff_cb, 0);
+#ifdef AVR_UART_FLAG_STDIO
+	uint32_t uf = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &uf);
+	uf &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &uf);
+#endif
+}
+
+static uint8_t load_baseline(const char* fn)
+{
+	FILE* f = fopen(fn, "r");
+	if( !f ) return 0;
+
+	char name[32];
+	unsigned cpc, cpb;
+	while( 3 == fscanf(f, "%31s %u %u", name, &cpc, &cpb) ) {
+		uint8_t i;
+		for( i = 0; i < NBENCH; ++i ) {
+			if( 0 == strcmp(name, benches[i].name) ) {
+				benches[i].cpc = cpc;
+				benches[i].cpb = cpb;
+			}
+		}
+	}
+	fclose(f);
+	return 1;
+}
+
+static uint8_t slower(uint32_t now, uint32_t base, double tol)
+{
+	return base && (now > base * (1.0 + tol / 100.0));
+}
+
+int main(int argc, char** argv)
+{
+	int wr = 0;
+	double tol = 2;
+	int c;
+
+	while( (c = getopt(argc, argv, "wt:")) != -1 ) {
+		if( c == 'w' ) wr = 1;
+		else if( c == 't' ) tol = atof(optarg);
+		else return 2;
+	}
+	if( argc - optind != 3 ) {
+		fprintf(stderr, "usage: simbench [-w] [-t pct] main.elf f_cpu baseline.txt\n");
+		return 2;
+	}
+	const char* elf = argv[optind];
+	uint32_t fcpu = strtoul(argv[optind+1], 0, 10);
+	const char* bfn = argv[optind+2];
+
+	uint32_t i;
+	for( i = 0; i < IMG_SIZE; ++i ) ee24_mem[i] = (i * 7 + (i >> 8)) & 0xff;
+	memset(tgt_flash, 0xff, sizeof(tgt_flash));
+	memset(tgt_ee, 0xff, sizeof(tgt_ee));
+	sim_ee24_init(ee24_mem);
+	sim_tgt_init(TGT_PART, tgt_flash, tgt_ee, tgt_fuse);
+
+	sim_start(elf, fcpu);
+
+	while( strcmp(run_line(), "RESET") ) ;
+	at(TGT_TARGET);
+
+	// a fresh checkout has nothing to gate on yet, this run becomes the baseline
+	if( !wr && !load_baseline(bfn) ) {
+		fprintf(stderr, "simbench: warning: no %s, recording this run as the baseline\n", bfn);
+		wr = 1;
+	}
+
+	FILE* bf = wr ? fopen(bfn, "w") : 0;
+	if( wr && !bf ) { perror(bfn); return 2; }
+
+	int fail = 0;
+
+	printf("F_CPU %u\n", fcpu);
+	printf("%-14s %10s %10s %6s\n", "path", "cyc/call", "cyc/byte", "calls");
+
+	for( i = 0; i < NBENCH; ++i ) {
+		struct bench_t* b = &benches[i];
+		char s[16];
+
+		sprintf(s, "AT+BENCH=%u", b->id);
+		at(s);
+		mark_cycles = 0;
+		mark_calls = 0;
+		b->run();
+		at("AT+BENCH=0");
+
+		if( mark_calls == 0 ) {
+			printf("%-14s no calls\n", b->name);
+			fail = 1;
+			continue;
+		}
+
+		uint32_t cpc = mark_cycles / mark_calls;
+		uint32_t cpb = b->bytes ? mark_cycles / ((uint64_t)mark_calls * b->bytes) : 0;
+
+		const char* flag = "";
+		if( slower(cpc, b->cpc, tol) || slower(cpb, b->cpb, tol) ) {
+			flag = "  SLOWER";
+			fail = 1;
+		} else
+		if( !wr && (b->cpc == 0) ) {
+			flag = "  NO BASELINE"; // a new path, make baseline adds it
+		}
+
+		printf("%-14s %10u %10u %6u  base %u %u%s\n", b->name, cpc, cpb, mark_calls, b->cpc, b->cpb, flag);
+
+		if( bf ) fprintf(bf, "%s %u %u\n", b->name, cpc, cpb);
+	}
+
+	if( bf ) fclose(bf);
+
+	if( sim_tgt_violations() ) {
+		printf("target timing violations: %u\n", sim_tgt_violations());
+		fail = 1;
+	}
+
+	return fail;
+}
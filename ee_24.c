@@ -10,11 +10,14 @@
 
 #include <inttypes.h>
 #include <avr/io.h>
+#include <util/delay.h>
 
 #include "mat/i2c.h"
 #include "string.h"
+#include "bench.h"
 
 #define EE24_I2C_ADR 0xa0 /**< EE I2C address */
+#define EE24_POLL_TRIES 60 /**< 100 us apart, covers the 5 ms write cycle */
 
 /**
 @brief Presently only calls i2c_init
@@ -31,6 +34,8 @@ void ee24_init(uint8_t br)
 @param[in]	buf		Pointer to data
 @param[in]	len		Number of bytes to write (len <= sizeof(buf))
 @return Same as i2c_writebuf
+@note The device NACKs while a previous write cycle is in progress, so the
+write is retried (acknowledge polling) until it is accepted or times out.
 */
 uint8_t ee24_wr(uint16_t adr, uint8_t* buf, uint8_t len)
 {
@@ -42,7 +47,13 @@ uint8_t ee24_wr(uint16_t adr, uint8_t* buf, uint8_t len)
 
 	if( len ) memcpy(buf2+2, buf, len);
 
-	return i2c_writebuf(EE24_I2C_ADR, buf2, len+2);
+	uint8_t r;
+	uint8_t n = EE24_POLL_TRIES;
+	while( (r = i2c_writebuf(EE24_I2C_ADR, buf2, len+2)) && --n ) {
+		_delay_us(100);
+	}
+
+	return r;
 }
 
 /**
@@ -54,6 +65,9 @@ uint8_t ee24_wr(uint16_t adr, uint8_t* buf, uint8_t len)
 */
 uint8_t ee24_rd(uint16_t adr, uint8_t* buf, uint8_t len)
 {
-	if( ee24_wr(adr, 0, 0) ) return 1;
-	return i2c_readbuf(EE24_I2C_ADR, buf, len);
+	BENCH_BEGIN(BENCH_EE24_RD);
+	uint8_t r = ee24_wr(adr, 0, 0);
+	if( r == 0 ) r = i2c_readbuf(EE24_I2C_ADR, buf, len);
+	BENCH_END(BENCH_EE24_RD);
+	return r;
 }
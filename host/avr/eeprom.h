@@ -0,0 +1,21 @@
+/**
+AVR isp bub - host build
+
+@file		avr/eeprom.h
+@brief		Internal EEPROM backed by a file
+*/
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <inttypes.h>
+
+uint8_t eeprom_read_byte(const uint8_t* p);
+uint16_t eeprom_read_word(const uint16_t* p);
+uint32_t eeprom_read_dword(const uint32_t* p);
+
+void eeprom_update_byte(uint8_t* p, uint8_t d);
+void eeprom_update_word(uint16_t* p, uint16_t d);
+void eeprom_update_dword(uint32_t* p, uint32_t d);
+
+#endif
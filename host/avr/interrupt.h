@@ -0,0 +1,22 @@
+/**
+AVR isp bub - host build
+
+@file		avr/interrupt.h
+@brief		Interrupts are delivered as host signals, cli/sei block them
+*/
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+void host_sei(void);
+void host_cli(void);
+
+#define sei() host_sei()
+#define cli() host_cli()
+
+#define ISR(vector) void vector(void)
+
+#define TIMER0_OVF_vect host_timer0_ovf_vect
+#define INT0_vect host_int0_vect
+
+#endif
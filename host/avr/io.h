@@ -0,0 +1,74 @@
+/**
+AVR isp bub - host build
+
+@file		avr/io.h
+@brief		ATmega8 I/O register file mapped onto host memory
+*/
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <inttypes.h>
+
+#ifndef RAMEND
+	#define RAMEND 0x45F
+#endif
+
+// the ATmega88/168/328P build only differs in timer 0 register names here
+
+#define _BV(b) (1 << (b))
+
+extern volatile uint8_t host_io[0x40];
+extern volatile uint16_t* host_tcnt1(void);
+
+#define _SFR_IO8(a) (host_io[(a)])
+
+#define PIND   _SFR_IO8(0x10)
+#define DDRD   _SFR_IO8(0x11)
+#define PORTD  _SFR_IO8(0x12)
+#define PINC   _SFR_IO8(0x13)
+#define DDRC   _SFR_IO8(0x14)
+#define PORTC  _SFR_IO8(0x15)
+#define PINB   _SFR_IO8(0x16)
+#define DDRB   _SFR_IO8(0x17)
+#define PORTB  _SFR_IO8(0x18)
+#define SPCR   _SFR_IO8(0x0D)
+#define TCCR1B _SFR_IO8(0x2E)
+#define TCCR1A _SFR_IO8(0x2F)
+#define TCNT0  _SFR_IO8(0x32)
+#define TIFR   _SFR_IO8(0x38)
+#define SREG   _SFR_IO8(0x3F)
+
+#define HOST_TCCR0 _SFR_IO8(0x33)
+#define HOST_TIMSK _SFR_IO8(0x39)
+#define HOST_EICR  _SFR_IO8(0x35)
+#define HOST_EIMSK _SFR_IO8(0x3B)
+#define HOST_EIFR  _SFR_IO8(0x3A)
+
+#ifdef HOST_MEGAX8
+	#define TCCR0B HOST_TCCR0
+	#define TIMSK0 HOST_TIMSK
+	#define EICRA HOST_EICR
+	#define EIMSK HOST_EIMSK
+	#define EIFR HOST_EIFR
+	#define INT0  0
+	#define INTF0 0
+#else
+	#define TCCR0 HOST_TCCR0
+	#define TIMSK HOST_TIMSK
+	#define MCUCR HOST_EICR
+	#define GICR HOST_EIMSK
+	#define GIFR HOST_EIFR
+	#define INT0  6
+	#define INTF0 6
+#endif
+
+#define ISC00 0
+#define ISC01 1
+
+#define TCNT1 (*host_tcnt1())
+
+#define TOIE0 0
+#define TOV1  2
+
+#endif
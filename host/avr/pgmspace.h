@@ -0,0 +1,28 @@
+/**
+AVR isp bub - host build
+
+@file		avr/pgmspace.h
+@brief		Flash and RAM share one address space on the host
+*/
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char*
+
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+#define pgm_read_dword(p) (*(const uint32_t*)(p))
+#define pgm_read_ptr(p) (*(const void* const*)(p))
+
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+#endif
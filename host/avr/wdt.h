@@ -0,0 +1,16 @@
+/**
+AVR isp bub - host build
+
+@file		avr/wdt.h
+@brief		Watchdog is a no-op on the host
+*/
+
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#define WDTO_2S 7
+
+#define wdt_reset()
+#define wdt_enable(t)
+
+#endif
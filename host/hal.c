@@ -0,0 +1,525 @@
+/**
+AVR isp bub - host build
+
+@file		hal.c
+@brief		Host hardware abstraction: clock, timer 0, button, internal
+			EEPROM, SPI, I2C and UART for running the firmware on Linux
+@note		Environment variables:
+			AVRISP_STATE	directory for the persistent memory images (host_state)
+			AVRISP_PTY		symlink created to the UART pty (AVRISP_STATE/tty)
+			AVRISP_TGT		simulated target part (atmega8)
+			AVRISP_FAST		set to 1 to skip SPI, I2C and UART bit timing
+			Send SIGUSR1 for a short button press, SIGUSR2 for a long one,
+			SIGHUP for a pulse on the handler start input.
+*/
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/delay.h>
+#include "mat/spi.h"
+#include "mat/i2c.h"
+#include "mat/serque.h"
+
+#include "hwdefs.h"
+#include "sim_ee24.h"
+#include "sim_tgt.h"
+
+#define HOST_EEPROM_SIZE 1024
+
+volatile uint8_t host_io[0x40];
+
+void TIMER0_OVF_vect(void);
+void INT0_vect(void);
+
+static uint64_t host_t0;
+static uint8_t host_fast = 0;
+static uint64_t host_debt = 0; // ns of bus time not yet slept
+
+static uint8_t* host_eeprom;
+
+static timer_t host_tmr;
+static volatile uint32_t host_btn_ticks = 0;
+static volatile uint32_t host_start_ticks = 0;
+
+static uint16_t host_tcnt1_val;
+static uint64_t host_tcnt1_at;
+
+static uint8_t host_spi_fdiv = 128;
+static uint32_t host_i2c_hz = 100000;
+
+// --- time -------------------------------------------------------------------
+
+static uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec - host_t0;
+}
+
+static uint64_t host_now(void)
+{
+	return host_now_ns() / 1000;
+}
+
+static void host_sleep_until(uint64_t ns)
+{
+	struct timespec ts;
+	ns += host_t0;
+	ts.tv_sec = ns / 1000000000ull;
+	ts.tv_nsec = ns % 1000000000ull;
+	while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR );
+}
+
+// account for time the AVR would spend shifting bits, sleep in 1 ms lumps
+static void host_spend(uint64_t ns)
+{
+	if( host_fast ) return;
+
+	host_debt += ns;
+	if( host_debt >= 1000000 ) {
+		host_sleep_until(host_now_ns() + host_debt);
+		host_debt = 0;
+	}
+}
+
+// the target reset line has no write hook, it is sampled whenever the
+// firmware touches the ISP pins or waits
+static void host_pins(void)
+{
+	uint8_t rst = (DDR(TRST_PORT) & _BV(TRST_BIT)) && !(TRST_PORT & _BV(TRST_BIT));
+	sim_tgt_reset(host_now(), rst);
+}
+
+void host_delay_us(double us)
+{
+	host_pins();
+	host_sleep_until(host_now_ns() + host_debt + (uint64_t)(us * 1000.0));
+	host_debt = 0;
+}
+
+// timer 1 free-runs with the prescaler selected in TCCR1B
+volatile uint16_t* host_tcnt1(void)
+{
+	static const uint16_t pre[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+	uint64_t ns = host_now_ns();
+	uint16_t p = pre[TCCR1B & 7];
+
+	if( p ) {
+		uint64_t tick = 1000000000ull * p / F_CPU;
+		uint64_t n = (ns - host_tcnt1_at) / tick;
+		host_tcnt1_val += n;
+		host_tcnt1_at += n * tick;
+	} else {
+		host_tcnt1_at = ns;
+	}
+
+	return &host_tcnt1_val;
+}
+
+// --- interrupts -------------------------------------------------------------
+
+static void host_irq_mask(int how)
+{
+	sigset_t s;
+	sigemptyset(&s);
+	sigaddset(&s, SIGALRM);
+	sigaddset(&s, SIGHUP);
+	sigprocmask(how, &s, 0);
+}
+
+void host_sei(void)
+{
+	SREG |= 0x80;
+	host_irq_mask(SIG_UNBLOCK);
+}
+
+void host_cli(void)
+{
+	host_irq_mask(SIG_BLOCK);
+	SREG &= ~0x80;
+}
+
+static void host_tmr_arm(void)
+{
+	// period follows the reload value the ISR writes, prescaler 1024
+	uint32_t cnt = 0x100 - TCNT0;
+	uint64_t ns = 1024000000000ull * cnt / F_CPU;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000ull;
+	its.it_value.tv_nsec = ns % 1000000000ull;
+	timer_settime(host_tmr, 0, &its, 0);
+}
+
+static void host_sigalrm(int sig)
+{
+	(void)sig;
+
+	if( host_btn_ticks ) {
+		--host_btn_ticks;
+		PIN(BTN_PORT) &= ~_BV(BTN_BIT);
+	} else {
+		PIN(BTN_PORT) |= _BV(BTN_BIT);
+	}
+
+	if( host_start_ticks ) {
+		--host_start_ticks;
+	} else {
+		PIN(HND_PORT) |= _BV(HND_START_BIT);
+	}
+
+	if( HOST_TIMSK & _BV(TOIE0) ) {
+		SREG &= ~0x80;
+		TIMER0_OVF_vect();
+		SREG |= 0x80;
+	}
+
+	host_tmr_arm();
+}
+
+static void host_sigusr(int sig)
+{
+	host_btn_ticks = (sig == SIGUSR1) ? 64 : 192;
+}
+
+// falling edge on INT0, the flag register is not modelled
+static void host_sighup(int sig)
+{
+	(void)sig;
+
+	uint8_t edge = PIN(HND_PORT) & _BV(HND_START_BIT);
+	host_start_ticks = 4;
+	PIN(HND_PORT) &= ~_BV(HND_START_BIT);
+
+	if( edge && ((HOST_EICR & (_BV(ISC01)|_BV(ISC00))) == _BV(ISC01)) && (HOST_EIMSK & _BV(INT0)) ) {
+		SREG &= ~0x80;
+		INT0_vect();
+		SREG |= 0x80;
+	}
+}
+
+static void host_sigterm(int sig)
+{
+	(void)sig;
+	exit(0);
+}
+
+// --- memories ---------------------------------------------------------------
+
+static const char* host_dir(void)
+{
+	const char* d = getenv("AVRISP_STATE");
+	return d ? d : "host_state";
+}
+
+static uint8_t* host_map(const char* name, size_t size)
+{
+	char fn[512];
+	snprintf(fn, sizeof(fn), "%s/%s", host_dir(), name);
+
+	int fd = open(fn, O_RDWR | O_CREAT, 0644);
+	if( fd < 0 ) { perror(fn); exit(1); }
+
+	struct stat st;
+	fstat(fd, &st);
+	if( (size_t)st.st_size < size ) { // new image, erased state
+		uint8_t ff[256];
+		memset(ff, 0xff, sizeof(ff));
+		lseek(fd, st.st_size, SEEK_SET);
+		size_t n = size - st.st_size;
+		while( n ) {
+			size_t k = n < sizeof(ff) ? n : sizeof(ff);
+			if( write(fd, ff, k) != (ssize_t)k ) { perror(fn); exit(1); }
+			n -= k;
+		}
+	}
+
+	uint8_t* p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( p == MAP_FAILED ) { perror(fn); exit(1); }
+	close(fd);
+
+	return p;
+}
+
+static void host_fini(void)
+{
+	fprintf(stderr, "host: %u target timing violations\n", sim_tgt_violations());
+}
+
+__attribute__((constructor)) static void host_init(void)
+{
+	host_t0 = 0;
+	host_t0 = host_now_ns();
+
+	host_fast = getenv("AVRISP_FAST") && (atoi(getenv("AVRISP_FAST")) != 0);
+
+	mkdir(host_dir(), 0755);
+	host_eeprom = host_map("eeprom.bin", HOST_EEPROM_SIZE);
+	sim_ee24_init(host_map("ee24.bin", SIM_EE24_SIZE));
+	sim_tgt_init(getenv("AVRISP_TGT"),
+		host_map("tgt_flash.bin", SIM_TGT_FLASH_MAX),
+		host_map("tgt_ee.bin", SIM_TGT_EE_MAX),
+		host_map("tgt_fuse.bin", SIM_TGT_FUSES));
+
+	memset((void*)host_io, 0, sizeof(host_io));
+	PINB = PINC = PIND = 0xff;
+
+	host_irq_mask(SIG_BLOCK); // interrupts are off until sei()
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = host_sigalrm;
+	sa.sa_flags = SA_RESTART;
+	sigaddset(&sa.sa_mask, SIGALRM); // the ISRs don't nest
+	sigaddset(&sa.sa_mask, SIGHUP);
+	sigaction(SIGALRM, &sa, 0);
+	sa.sa_handler = host_sighup;
+	sigaction(SIGHUP, &sa, 0);
+	sa.sa_handler = host_sigusr;
+	sigaction(SIGUSR1, &sa, 0);
+	sigaction(SIGUSR2, &sa, 0);
+	sa.sa_handler = host_sigterm;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGALRM;
+	timer_create(CLOCK_MONOTONIC, &sev, &host_tmr);
+	host_tmr_arm();
+
+	atexit(host_fini);
+}
+
+uint8_t eeprom_read_byte(const uint8_t* p)
+{
+	return host_eeprom[(uintptr_t)p % HOST_EEPROM_SIZE];
+}
+
+uint16_t eeprom_read_word(const uint16_t* p)
+{
+	const uint8_t* b = (const uint8_t*)p;
+	return eeprom_read_byte(b) | (eeprom_read_byte(b+1) << 8);
+}
+
+uint32_t eeprom_read_dword(const uint32_t* p)
+{
+	const uint16_t* w = (const uint16_t*)p;
+	return eeprom_read_word(w) | ((uint32_t)eeprom_read_word(w+1) << 16);
+}
+
+void eeprom_update_byte(uint8_t* p, uint8_t d)
+{
+	uint8_t* e = &host_eeprom[(uintptr_t)p % HOST_EEPROM_SIZE];
+	if( *e == d ) return;
+	*e = d;
+	host_delay_us(8500); // ATmega8 EEPROM write time
+}
+
+void eeprom_update_word(uint16_t* p, uint16_t d)
+{
+	uint8_t* b = (uint8_t*)p;
+	eeprom_update_byte(b, d);
+	eeprom_update_byte(b+1, d >> 8);
+}
+
+void eeprom_update_dword(uint32_t* p, uint32_t d)
+{
+	uint16_t* w = (uint16_t*)p;
+	eeprom_update_word(w, d);
+	eeprom_update_word(w+1, d >> 16);
+}
+
+// --- SPI, I2C ---------------------------------------------------------------
+
+void spi_init(uint8_t fdiv)
+{
+	host_spi_fdiv = fdiv;
+	host_pins();
+}
+
+uint8_t spi_rw(uint8_t d)
+{
+	host_spend(8000000000ull * host_spi_fdiv / F_CPU);
+	host_pins();
+	return sim_tgt_spi(host_now(), d);
+}
+
+void i2c_init(uint16_t br)
+{
+	host_i2c_hz = br * 1000ul;
+	if( host_i2c_hz > F_CPU / 16 ) host_i2c_hz = F_CPU / 16;
+}
+
+uint8_t i2c_writebuf(uint8_t adr, uint8_t* buf, uint8_t len)
+{
+	host_spend(9000000000ull * (len + 1) / host_i2c_hz);
+	if( adr != 0xa0 ) return 1;
+	return sim_ee24_wr(host_now(), buf, len);
+}
+
+uint8_t i2c_readbuf(uint8_t adr, uint8_t* buf, uint8_t len)
+{
+	host_spend(9000000000ull * (len + 1) / host_i2c_hz);
+	if( adr != 0xa0 ) return 1;
+	return sim_ee24_rd(host_now(), buf, len);
+}
+
+// --- UART -------------------------------------------------------------------
+
+#define HOST_RXQ 4096
+
+static int host_pty = -1;
+static int host_pts = -1;
+static uint64_t host_char_ns;
+static uint8_t host_rxs;
+static uint8_t host_txs;
+
+static uint8_t host_rxq[HOST_RXQ];
+static uint64_t host_rxq_at[HOST_RXQ];
+static uint16_t host_rxq_h = 0;
+static uint16_t host_rxq_t = 0;
+static uint64_t host_tx_done = 0;
+
+void ser_init(uint8_t n, uint32_t br, uint8_t* txb, uint8_t txs, uint8_t* rxb, uint8_t rxs)
+{
+	(void)n; (void)txb; (void)rxb;
+
+	host_char_ns = 10000000000ull / br;
+	host_rxs = rxs;
+	host_txs = txs;
+
+	host_pty = posix_openpt(O_RDWR | O_NOCTTY);
+	if( host_pty < 0 || grantpt(host_pty) || unlockpt(host_pty) ) { perror("pty"); exit(1); }
+	fcntl(host_pty, F_SETFL, O_NONBLOCK);
+
+	// keep the slave open so the master never sees a hangup
+	host_pts = open(ptsname(host_pty), O_RDWR | O_NOCTTY);
+	struct termios t;
+	tcgetattr(host_pts, &t);
+	cfmakeraw(&t);
+	tcsetattr(host_pts, TCSANOW, &t);
+
+	char ln[512];
+	const char* l = getenv("AVRISP_PTY");
+	if( l == 0 ) {
+		snprintf(ln, sizeof(ln), "%s/tty", host_dir());
+		l = ln;
+	}
+	unlink(l);
+	if( symlink(ptsname(host_pty), l) ) perror(l);
+
+	fprintf(stderr, "uart: %s -> %s, %u baud\n", l, ptsname(host_pty), br);
+}
+
+uint8_t ser_getc(uint8_t n, uint8_t* d)
+{
+	(void)n;
+
+	uint64_t now = host_now_ns();
+
+	// pull whatever the host wrote, each char arrives one frame after the previous
+	uint8_t c;
+	while( ((host_rxq_t + 1) % HOST_RXQ != host_rxq_h) && (read(host_pty, &c, 1) == 1) ) {
+		uint64_t prev = (host_rxq_t != host_rxq_h) ? host_rxq_at[(host_rxq_t + HOST_RXQ - 1) % HOST_RXQ] : 0;
+		host_rxq[host_rxq_t] = c;
+		host_rxq_at[host_rxq_t] = (prev > now ? prev : now) + (host_fast ? 0 : host_char_ns);
+		host_rxq_t = (host_rxq_t + 1) % HOST_RXQ;
+	}
+
+	// chars that arrived while the firmware was busy and no longer fit in the ring are lost
+	uint16_t ready = 0;
+	uint16_t i;
+	for( i = host_rxq_h; i != host_rxq_t && host_rxq_at[i] <= now; i = (i + 1) % HOST_RXQ ) ++ready;
+	while( ready > (uint16_t)host_rxs + 1 ) {
+		fprintf(stderr, "uart: rx overrun, dropped %02x\n", host_rxq[(host_rxq_h + host_rxs + 1) % HOST_RXQ]);
+		uint16_t j = (host_rxq_h + host_rxs + 1) % HOST_RXQ;
+		for( ; (j + 1) % HOST_RXQ != host_rxq_t; j = (j + 1) % HOST_RXQ ) {
+			host_rxq[j] = host_rxq[(j + 1) % HOST_RXQ];
+		}
+		host_rxq_t = (host_rxq_t + HOST_RXQ - 1) % HOST_RXQ;
+		--ready;
+	}
+
+	if( ready == 0 ) {
+		if( host_rxq_h == host_rxq_t ) {
+			struct timespec ts = {0, 20000};
+			nanosleep(&ts, 0); // idle main loop, don't hog the host
+		}
+		return 0;
+	}
+
+	*d = host_rxq[host_rxq_h];
+	host_rxq_h = (host_rxq_h + 1) % HOST_RXQ;
+	return 1;
+}
+
+void ser_putc(uint8_t n, char c)
+{
+	(void)n;
+
+	if( !host_fast ) {
+		uint64_t now = host_now_ns();
+		if( host_tx_done < now ) host_tx_done = now;
+		// ring full, wait until the oldest char has been shifted out
+		if( host_tx_done - now > host_txs * host_char_ns ) {
+			host_sleep_until(host_tx_done - host_txs * host_char_ns);
+		}
+		host_tx_done += host_char_ns;
+	}
+
+	while( write(host_pty, &c, 1) != 1 ) {
+		if( errno != EAGAIN && errno != EINTR ) break;
+	}
+}
+
+void ser_puts(uint8_t n, const char* s)
+{
+	while( *s ) ser_putc(n, *s++);
+}
+
+void ser_puts_P(uint8_t n, const char* s)
+{
+	ser_puts(n, s);
+}
+
+void ser_puti_lc(uint8_t n, int32_t x, uint8_t base, uint8_t l, char c)
+{
+	char b[34];
+	uint8_t i = sizeof(b);
+	uint32_t u = x;
+
+	b[--i] = 0;
+	if( (base == 10) && (x < 0) ) u = -x;
+	do {
+		uint8_t d = u % base;
+		b[--i] = d < 10 ? '0' + d : 'a' + d - 10;
+		u /= base;
+	} while( u && i > 1 );
+	if( (base == 10) && (x < 0) ) b[--i] = '-';
+	while( (sizeof(b) - 1 - i < l) && i ) b[--i] = c;
+
+	ser_puts(n, b + i);
+}
+
+void ser_puti(uint8_t n, int32_t x, uint8_t base)
+{
+	ser_puti_lc(n, x, base, 0, ' ');
+}
@@ -0,0 +1,20 @@
+/**
+AVR isp bub - host build
+
+@file		mat/i2c.h
+@brief		I2C master wired to the simulated 24C512
+*/
+
+#ifndef MAT_I2C_H
+#define MAT_I2C_H
+
+#include <inttypes.h>
+
+#define I2C_100K 100
+#define I2C_400K 400
+
+void i2c_init(uint16_t br);
+uint8_t i2c_writebuf(uint8_t adr, uint8_t* buf, uint8_t len);
+uint8_t i2c_readbuf(uint8_t adr, uint8_t* buf, uint8_t len);
+
+#endif
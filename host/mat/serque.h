@@ -0,0 +1,29 @@
+/**
+AVR isp bub - host build
+
+@file		mat/serque.h
+@brief		Queued serial port connected to a pseudo terminal
+*/
+
+#ifndef MAT_SERQUE_H
+#define MAT_SERQUE_H
+
+#include <inttypes.h>
+
+#define BAUD_4800 4800
+#define BAUD_9600 9600
+#define BAUD_19200 19200
+#define BAUD_38400 38400
+#define BAUD_57600 57600
+#define BAUD_76800 76800
+#define BAUD_115200 115200
+
+void ser_init(uint8_t n, uint32_t br, uint8_t* txb, uint8_t txs, uint8_t* rxb, uint8_t rxs);
+uint8_t ser_getc(uint8_t n, uint8_t* d);
+void ser_putc(uint8_t n, char c);
+void ser_puts(uint8_t n, const char* s);
+void ser_puts_P(uint8_t n, const char* s);
+void ser_puti(uint8_t n, int32_t x, uint8_t base);
+void ser_puti_lc(uint8_t n, int32_t x, uint8_t base, uint8_t l, char c);
+
+#endif
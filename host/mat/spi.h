@@ -0,0 +1,24 @@
+/**
+AVR isp bub - host build
+
+@file		mat/spi.h
+@brief		SPI master wired to the simulated target AVR
+*/
+
+#ifndef MAT_SPI_H
+#define MAT_SPI_H
+
+#include <inttypes.h>
+
+#define SPI_FDIV_2 2
+#define SPI_FDIV_4 4
+#define SPI_FDIV_8 8
+#define SPI_FDIV_16 16
+#define SPI_FDIV_32 32
+#define SPI_FDIV_64 64
+#define SPI_FDIV_128 128
+
+void spi_init(uint8_t fdiv);
+uint8_t spi_rw(uint8_t d);
+
+#endif
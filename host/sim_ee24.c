@@ -0,0 +1,66 @@
+/**
+AVR isp bub - host build
+
+@file		sim_ee24.c
+@brief		Behavioural 24C512 model
+@note		The device NACKs its address during the internal write cycle
+			and page writes wrap around within the 128 byte page, just
+			like the real part.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "sim_ee24.h"
+
+static uint8_t* ee24_mem;
+static uint16_t ee24_ptr;
+static uint64_t ee24_busy;
+
+void sim_ee24_init(uint8_t* mem)
+{
+	ee24_mem = mem;
+	ee24_ptr = 0;
+	ee24_busy = 0;
+}
+
+// returns 1 (NACK) while a write cycle is in progress
+uint8_t sim_ee24_wr(uint64_t now, const uint8_t* buf, uint16_t len)
+{
+	if( now < ee24_busy ) return 1;
+
+	if( len < 2 ) return 1;
+	ee24_ptr = (buf[0] << 8) | buf[1];
+	buf += 2;
+	len -= 2;
+
+	if( len == 0 ) return 0; // address only, start of a random read
+
+	uint16_t pg = ee24_ptr & ~(SIM_EE24_PAGE-1);
+	if( len > SIM_EE24_PAGE ) {
+		fprintf(stderr, "ee24: page write of %u bytes truncated\n", len);
+	}
+	while( len-- ) {
+		ee24_mem[ee24_ptr] = *buf++;
+		ee24_ptr = pg | ((ee24_ptr + 1) & (SIM_EE24_PAGE-1));
+	}
+
+	ee24_busy = now + SIM_EE24_TWR_US;
+	return 0;
+}
+
+uint8_t sim_ee24_rd(uint64_t now, uint8_t* buf, uint16_t len)
+{
+	if( now < ee24_busy ) return 1;
+
+	while( len-- ) {
+		*buf++ = ee24_mem[ee24_ptr++];
+	}
+
+	return 0;
+}
+
+uint8_t sim_ee24_busy(uint64_t now)
+{
+	return now < ee24_busy;
+}
@@ -0,0 +1,22 @@
+/**
+AVR isp bub - host build
+
+@file		sim_ee24.h
+@brief		Behavioural 24C512 model
+*/
+
+#ifndef SIM_EE24_H
+#define SIM_EE24_H
+
+#include <inttypes.h>
+
+#define SIM_EE24_SIZE 0x10000
+#define SIM_EE24_PAGE 128
+#define SIM_EE24_TWR_US 5000
+
+void sim_ee24_init(uint8_t* mem);
+uint8_t sim_ee24_wr(uint64_t now, const uint8_t* buf, uint16_t len);
+uint8_t sim_ee24_rd(uint64_t now, uint8_t* buf, uint16_t len);
+uint8_t sim_ee24_busy(uint64_t now);
+
+#endif
@@ -0,0 +1,234 @@
+/**
+AVR isp bub - host build
+
+@file		sim_tgt.c
+@brief		Simulated target AVR speaking the serial programming protocol
+@note		Instructions issued while a write is still in progress are
+			dropped (reads return 0xff) and counted as violations, so
+			any shortcut in the programmer's timing shows up as a verify
+			failure instead of passing silently.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_tgt.h"
+
+struct tgt_part {
+	const char* name;
+	uint32_t sig;
+	uint32_t flash;
+	uint16_t pgsize;
+	uint16_t ee;
+	uint8_t eepgsize; // 0 = byte access only
+	uint8_t rdybsy; // answers Poll RDY/BSY
+	uint16_t twd_flash; // us
+	uint16_t twd_ee;
+	uint16_t twd_erase;
+	uint16_t twd_fuse;
+	uint8_t fuses[SIM_TGT_FUSES]; // factory lfuse, hfuse, efuse, lock
+};
+
+static const struct tgt_part tgt_parts[] = {
+	{"atmega8",     0x1e9307, 0x2000,  64,  512, 0, 0, 4500, 9000, 9000, 4500, {0xe1,0xd9,0xff,0xff}},
+	{"attiny2313",  0x1e910a, 0x0800,  32,  128, 4, 1, 4500, 4000, 9000, 4500, {0x64,0xdf,0xff,0xff}},
+	{"atmega328p",  0x1e950f, 0x8000, 128, 1024, 4, 1, 4500, 3600, 9000, 4500, {0x62,0xd9,0xff,0xff}},
+	{"atmega1284p", 0x1e9705, 0x20000, 256, 4096, 8, 1, 4500, 3600, 9000, 4500, {0x62,0x99,0xff,0xff}},
+};
+
+static const struct tgt_part* tgt;
+
+static uint8_t* tgt_flash;
+static uint8_t* tgt_ee;
+static uint8_t* tgt_fuse;
+
+static uint8_t tgt_pgbuf[256];
+static uint8_t tgt_eepgbuf[8];
+static uint8_t tgt_eepgmask;
+
+static uint8_t tgt_rst = 0;
+static uint64_t tgt_rst_at = 0;
+static uint32_t tgt_rst_us = 20000;
+static uint8_t tgt_prgen = 0;
+static uint8_t tgt_ext = 0;
+static uint64_t tgt_busy = 0;
+static uint32_t tgt_viol = 0;
+
+static uint8_t tgt_cmd[4];
+static uint8_t tgt_pos = 0;
+
+void sim_tgt_init(const char* part, uint8_t* flash, uint8_t* ee, uint8_t* fuses)
+{
+	uint8_t i;
+
+	tgt = &tgt_parts[0];
+	for( i = 0; i < sizeof(tgt_parts)/sizeof(tgt_parts[0]); ++i ) {
+		if( part && (0 == strcmp(part, tgt_parts[i].name)) ) tgt = &tgt_parts[i];
+	}
+
+	tgt_flash = flash;
+	tgt_ee = ee;
+	tgt_fuse = fuses;
+
+	// a blank fuse file means a factory fresh part
+	if( (fuses[0] & fuses[1] & fuses[2] & fuses[3]) == 0xff ) {
+		memcpy(fuses, tgt->fuses, SIM_TGT_FUSES);
+	}
+
+	const char* s = getenv("AVRISP_TGT_RST_MS");
+	if( s ) tgt_rst_us = atoi(s) * 1000;
+
+	memset(tgt_pgbuf, 0xff, sizeof(tgt_pgbuf));
+
+	fprintf(stderr, "target: %s sig %06x, %u byte pages\n", tgt->name, tgt->sig, tgt->pgsize);
+}
+
+void sim_tgt_reset(uint64_t now, uint8_t active)
+{
+	if( active == tgt_rst ) return;
+
+	tgt_rst = active;
+	tgt_rst_at = now;
+	tgt_prgen = 0;
+	tgt_pos = 0;
+	tgt_ext = 0;
+}
+
+uint32_t sim_tgt_violations(void)
+{
+	return tgt_viol;
+}
+
+static uint32_t tgt_waddr(void)
+{
+	return ((uint32_t)tgt_ext << 16) | (tgt_cmd[1] << 8) | tgt_cmd[2];
+}
+
+// data byte returned in the 4th byte of an instruction
+static uint8_t tgt_read(void)
+{
+	uint32_t a;
+
+	switch( tgt_cmd[0] ) {
+		case 0x20:
+		case 0x28:
+			a = (tgt_waddr() << 1) | (tgt_cmd[0] == 0x28);
+			return a < tgt->flash ? tgt_flash[a] : 0xff;
+		case 0xa0:
+			a = ((tgt_cmd[1] << 8) | tgt_cmd[2]) & (tgt->ee - 1);
+			return tgt_ee[a];
+		case 0x30:
+			return tgt->sig >> (8 * (2 - (tgt_cmd[2] & 3)));
+		case 0x50:
+			return tgt_fuse[tgt_cmd[1] == 0x08 ? 2 : 0];
+		case 0x58:
+			return tgt_fuse[tgt_cmd[1] == 0x08 ? 1 : 3];
+	}
+
+	return 0xff;
+}
+
+static void tgt_exec(uint64_t now)
+{
+	uint32_t a;
+	uint16_t i;
+
+	switch( tgt_cmd[0] ) {
+		case 0x40: // load program memory page
+		case 0x48:
+			a = ((((tgt_cmd[1] << 8) | tgt_cmd[2]) << 1) | (tgt_cmd[0] == 0x48)) & (tgt->pgsize - 1);
+			tgt_pgbuf[a] = tgt_cmd[3];
+			break;
+		case 0x4c: // write program memory page, flash cells can only go from 1 to 0
+			a = (tgt_waddr() << 1) & ~(uint32_t)(tgt->pgsize - 1);
+			if( a < tgt->flash ) {
+				for( i = 0; i < tgt->pgsize; ++i ) tgt_flash[a+i] &= tgt_pgbuf[i];
+			}
+			memset(tgt_pgbuf, 0xff, sizeof(tgt_pgbuf));
+			tgt_busy = now + tgt->twd_flash;
+			break;
+		case 0x4d: // load extended address
+			tgt_ext = tgt_cmd[2];
+			break;
+		case 0xc0: // write eeprom byte
+			a = ((tgt_cmd[1] << 8) | tgt_cmd[2]) & (tgt->ee - 1);
+			tgt_ee[a] = tgt_cmd[3];
+			tgt_busy = now + tgt->twd_ee;
+			break;
+		case 0xc1: // load eeprom page
+			if( tgt->eepgsize ) {
+				a = tgt_cmd[2] & (tgt->eepgsize - 1);
+				tgt_eepgbuf[a] = tgt_cmd[3];
+				tgt_eepgmask |= 1 << a;
+			}
+			break;
+		case 0xc2: // write eeprom page
+			if( tgt->eepgsize ) {
+				a = ((tgt_cmd[1] << 8) | tgt_cmd[2]) & (tgt->ee - 1) & ~(tgt->eepgsize - 1);
+				for( i = 0; i < tgt->eepgsize; ++i ) {
+					if( tgt_eepgmask & (1 << i) ) tgt_ee[a+i] = tgt_eepgbuf[i];
+				}
+				tgt_eepgmask = 0;
+				tgt_busy = now + tgt->twd_ee;
+			}
+			break;
+		case 0xac:
+			switch( tgt_cmd[1] ) {
+				case 0x80: // chip erase
+					memset(tgt_flash, 0xff, tgt->flash);
+					memset(tgt_ee, 0xff, tgt->ee);
+					tgt_fuse[3] = 0xff;
+					tgt_busy = now + tgt->twd_erase;
+					break;
+				case 0xa0: tgt_fuse[0] = tgt_cmd[3]; tgt_busy = now + tgt->twd_fuse; break;
+				case 0xa8: tgt_fuse[1] = tgt_cmd[3]; tgt_busy = now + tgt->twd_fuse; break;
+				case 0xa4: tgt_fuse[2] = tgt_cmd[3]; tgt_busy = now + tgt->twd_fuse; break;
+				case 0xe0: tgt_fuse[3] = tgt_cmd[3]; tgt_busy = now + tgt->twd_fuse; break;
+			}
+			break;
+	}
+}
+
+uint8_t sim_tgt_spi(uint64_t now, uint8_t mosi)
+{
+	if( !tgt_rst ) return 0xff; // target running, pins belong to it
+
+	uint8_t miso = 0xff;
+
+	tgt_cmd[tgt_pos] = mosi;
+
+	if( tgt_pos == 1 || tgt_pos == 2 ) {
+		// serial programming echoes the previous byte
+		miso = tgt_cmd[tgt_pos-1];
+		if( !tgt_prgen && !(tgt_cmd[0] == 0xac && tgt_cmd[1] == 0x53) ) miso = 0;
+	}
+
+	if( tgt_pos == 2 && tgt_cmd[0] == 0xac && tgt_cmd[1] == 0x53 ) {
+		if( now - tgt_rst_at >= tgt_rst_us ) {
+			tgt_prgen = 1;
+		} else {
+			miso = 0; // not in sync yet
+		}
+	}
+
+	if( tgt_pos == 3 ) {
+		tgt_pos = 0;
+		if( !tgt_prgen ) return 0xff;
+		if( tgt_cmd[0] == 0xf0 ) return tgt->rdybsy ? (now < tgt_busy) : 0xff; // poll rdy/bsy, no answer without it
+		if( now < tgt_busy ) {
+			if( tgt_viol++ < 10 ) {
+				fprintf(stderr, "target: instruction %02x %02x %02x %02x while busy\n",
+					tgt_cmd[0], tgt_cmd[1], tgt_cmd[2], tgt_cmd[3]);
+			}
+			return 0xff;
+		}
+		miso = tgt_read();
+		tgt_exec(now);
+		return miso;
+	}
+
+	++tgt_pos;
+	return miso;
+}
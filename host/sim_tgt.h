@@ -0,0 +1,22 @@
+/**
+AVR isp bub - host build
+
+@file		sim_tgt.h
+@brief		Simulated target AVR speaking the serial programming protocol
+*/
+
+#ifndef SIM_TGT_H
+#define SIM_TGT_H
+
+#include <inttypes.h>
+
+#define SIM_TGT_FLASH_MAX 0x20000
+#define SIM_TGT_EE_MAX 0x1000
+#define SIM_TGT_FUSES 4
+
+void sim_tgt_init(const char* part, uint8_t* flash, uint8_t* ee, uint8_t* fuses);
+void sim_tgt_reset(uint64_t now, uint8_t active);
+uint8_t sim_tgt_spi(uint64_t now, uint8_t mosi);
+uint32_t sim_tgt_violations(void);
+
+#endif
@@ -0,0 +1,37 @@
+/**
+AVR isp bub - host build
+
+@file		util/atomic.h
+@brief		ATOMIC_BLOCK on top of the host cli/sei
+*/
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+static inline uint8_t host_atomic_cli(void)
+{
+	cli();
+	return 1;
+}
+
+static inline void host_atomic_restore(const uint8_t* sreg)
+{
+	if( *sreg & 0x80 ) sei();
+}
+
+static inline void host_atomic_on(const uint8_t* sreg)
+{
+	(void)sreg;
+	sei();
+}
+
+#define ATOMIC_RESTORESTATE uint8_t host_sreg __attribute__((__cleanup__(host_atomic_restore))) = SREG
+#define ATOMIC_FORCEON uint8_t host_sreg __attribute__((__cleanup__(host_atomic_on))) = 0
+
+#define ATOMIC_BLOCK(type) for( type, host_todo = host_atomic_cli(); host_todo; host_todo = 0 )
+
+#endif
@@ -0,0 +1,29 @@
+/**
+AVR isp bub - host build
+
+@file		util/crc16.h
+@brief		Portable equivalents of the avr-libc CRC routines
+*/
+
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <inttypes.h>
+
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+	uint8_t i;
+
+	crc = crc ^ ((uint16_t)data << 8);
+	for( i = 0; i < 8; ++i ) {
+		if( crc & 0x8000 ) {
+			crc = (crc << 1) ^ 0x1021;
+		} else {
+			crc <<= 1;
+		}
+	}
+
+	return crc;
+}
+
+#endif
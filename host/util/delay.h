@@ -0,0 +1,16 @@
+/**
+AVR isp bub - host build
+
+@file		util/delay.h
+@brief		Busy wait delays become host sleeps
+*/
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+void host_delay_us(double us);
+
+#define _delay_ms(ms) host_delay_us((ms) * 1000.0)
+#define _delay_us(us) host_delay_us(us)
+
+#endif
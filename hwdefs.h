@@ -19,6 +19,15 @@
 	#define TRST_PORT PORTD
 	#define TRST_BIT 5
 
+	#define HND_PORT PORTD
+	#define HND_START_BIT 2 // INT0
+	#define HND_BUSY_BIT 3
+	#define HND_PASS_BIT 4
+	#define HND_FAIL_BIT 6
+
+	#define BENCH_PORT PORTD
+	#define BENCH_BIT 7
+
 	#define DDR(x) (*(&x - 1))
 	#define PIN(x) (*(&x - 2))
 
@@ -9,36 +9,101 @@ AVR isp bub
 #include <inttypes.h>
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include "mat/spi.h"
+#include "isp.h"
 #include "hwdefs.h"
-
-#define ISP_FLASH_PAGE_DELAY_MS 10
-#define ISP_CHIP_ERASE_DELAY_MS 20
-#define ISP_FUSE_WR_DELAY_MS 10
-#define ISP_EE_WR_DELAY_MS 6
-
+#include "bench.h"
+#include "trace.h"
+
+// write times in 0.1 ms for parts not in isp_devs, enough for any of them
+#define ISP_FLASH_PAGE_DELAY 100
+#define ISP_CHIP_ERASE_DELAY 200
+#define ISP_FUSE_WR_DELAY 100
+#define ISP_EE_WR_DELAY 100
+#define ISP_RDYBSY_TIMEOUT 250 // parts with Poll RDY/BSY are polled this long at most
+
+// SCK must stay below 1/4 of the target clock, targets ship running at 1 MHz.
+// ISP_SCK_DEF is the default rung of isp_sck_fdiv.
 #if F_CPU == 1000000
-	#define ISP_SPI_FDIV SPI_FDIV_8
+	#define ISP_SCK_DEF 2 // F_CPU/8
 #elif F_CPU == 8000000
-	#define ISP_SPI_FDIV SPI_FDIV_64
+	#define ISP_SCK_DEF 5 // F_CPU/64
+#elif (F_CPU == 16000000) || (F_CPU == 20000000)
+	#define ISP_SCK_DEF 6 // F_CPU/128
+#else
+	#error "no ISP_SCK_DEF for this F_CPU"
 #endif
 
-static const uint8_t ISP_FUSE_RD_CMD[4][2] = {
+#define ISP_RST_MS_DEF 21 // min 20 ms after reset before programming enable
+#define ISP_RST_MS_MAX 100
+#define ISP_CONN_TRIES 16
+#define ISP_CONN_TIME 10000 // 0.1 ms, no new reset cycle after this
+#define ISP_SYNC_PULSES 8 // one per bit position
+
+// timer 1 counts at F_CPU/1024, round up so the delay is never shorter
+#define ISP_TMR_100US(t) ((uint16_t)(((uint32_t)(t) * (F_CPU / 100) + 102399) / 102400))
+
+static const uint8_t ISP_FUSE_RD_CMD[4][2] PROGMEM = {
 	{0x50, 0}, // lfuse
 	{0x58, 8}, // hfuse
 	{0x50, 8}, // efuse
 	{0x58, 0}  // lock
 };
 
-static const uint8_t ISP_FUSE_WR_CMD[4] = {
+static const uint8_t ISP_FUSE_WR_CMD[4] PROGMEM = {
 	0xa0, // lfuse
 	0xa8, // hfuse
 	0xa4, // efuse
 	0xe0  // lock
 };
 
+static const uint8_t isp_sck_fdiv[ISP_SCK_N] PROGMEM = {
+	SPI_FDIV_2, SPI_FDIV_4, SPI_FDIV_8, SPI_FDIV_16, SPI_FDIV_32, SPI_FDIV_64, SPI_FDIV_128
+};
+
+// datasheet serial programming characteristics
+static const struct isp_dev isp_devs[] PROGMEM = {
+	// sig    pg  eepg flags           flash ee erase
+	{0x9307,  32, 0, 0,                 45, 90, 90}, // ATmega8
+	{0x9403,  64, 0, 0,                 45, 90, 90}, // ATmega16
+	{0x9502,  64, 0, 0,                 45, 90, 90}, // ATmega32
+	{0x9205,  32, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega48
+	{0x920a,  32, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega48P
+	{0x930a,  32, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega88
+	{0x930f,  32, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega88P
+	{0x9406,  64, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega168
+	{0x940b,  64, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega168P
+	{0x9514,  64, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega328
+	{0x950f,  64, 4, ISP_DEV_RDYBSY,    45, 36, 90}, // ATmega328P
+	{0x960a, 128, 8, ISP_DEV_RDYBSY,    45, 90, 90}, // ATmega644P
+	{0x9705, 128, 8, ISP_DEV_RDYBSY,    45, 90, 90}, // ATmega1284P
+	{0x910a,  16, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny2313
+	{0x920d,  32, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny4313
+	{0x910b,  16, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny24
+	{0x9207,  32, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny44
+	{0x930c,  32, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny84
+	{0x9108,  16, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny25
+	{0x9206,  32, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny45
+	{0x930b,  32, 4, ISP_DEV_RDYBSY,    45, 40, 90}, // ATtiny85
+};
+
+static uint8_t isp_busy = 0;
+static uint16_t isp_ready;
+
+// write times of the current target
+static uint8_t isp_t_flash = ISP_FLASH_PAGE_DELAY;
+static uint8_t isp_t_ee = ISP_EE_WR_DELAY;
+static uint8_t isp_t_erase = ISP_CHIP_ERASE_DELAY;
+static uint8_t isp_rdybsy = 0;
+static uint8_t isp_eepg = 0;
+
+static uint8_t isp_rst_ms = ISP_RST_MS_DEF;
+static uint8_t isp_sck = ISP_SCK_DEF;
+static uint8_t isp_tries = 0;
+
 // --- private ----------------------------------------------------------------
 
 void _spi_deinit(void)
@@ -72,11 +137,53 @@ void isp_trst(uint8_t on)
 		_spi_deinit();
 		TRST_PORT |= _BV(TRST_BIT);
 	} else {
-		spi_init(ISP_SPI_FDIV);
+		spi_init(pgm_read_byte(&isp_sck_fdiv[isp_sck]));
 		TRST_PORT &= ~_BV(TRST_BIT);
 	}
 }
 
+// a positive SCK pulse shifts the target's bit framing by one, the datasheet
+// way to regain sync without a reset cycle
+void isp_sck_pulse(void)
+{
+	SPCR = 0;
+	SPI_PORT |= _BV(SCK_BIT);
+	_delay_us(10);
+	SPI_PORT &= ~_BV(SCK_BIT);
+	spi_init(pgm_read_byte(&isp_sck_fdiv[isp_sck]));
+}
+
+uint8_t isp_poll(void)
+{
+	spi_rw(0xf0);
+	spi_rw(0);
+	spi_rw(0);
+	return spi_rw(0) & 1;
+}
+
+// worst case write times until isp_dev_use() knows the part
+void isp_dev_default(void)
+{
+	isp_t_flash = ISP_FLASH_PAGE_DELAY;
+	isp_t_ee = ISP_EE_WR_DELAY;
+	isp_t_erase = ISP_CHIP_ERASE_DELAY;
+	isp_rdybsy = 0;
+	isp_eepg = 0;
+}
+
+// target is busy writing for at most t * 0.1 ms
+void isp_busy_for(uint8_t t)
+{
+	TCCR1B = 0;
+	TCNT1 = 0;
+	// t_WD is typical for some parts, the ones that can tell are asked instead.
+	// The prescaler is shared with timer 0 and free running, so the first tick
+	// comes early by up to a whole one, wait one more.
+	isp_ready = ISP_TMR_100US(isp_rdybsy ? ISP_RDYBSY_TIMEOUT : t) + 1;
+	isp_busy = 1;
+	TCCR1B = 5; // prescaler 1024
+}
+
 void isp_ext_addr(uint32_t addr)
 {
 	spi_rw(0x4d);
@@ -95,31 +202,107 @@ void isp_init(void)
 	isp_trst(1);
 }
 
+// NOTE: write functions return as soon as the instruction is issued, the
+// next call into isp waits out the remaining write time, or polls a part
+// with Poll RDY/BSY until it reports ready
+void isp_wait(void)
+{
+	if( isp_busy ) {
+		while( TCNT1 < isp_ready ) {
+			wdt_reset();
+			if( isp_rdybsy && !isp_poll() ) break;
+		}
+		TCCR1B = 0;
+		isp_busy = 0;
+	}
+}
+
+// starting point for isp_connect, normally what worked last time
+void isp_conn_set(uint8_t rst_ms, uint8_t sck)
+{
+	isp_rst_ms = ((rst_ms < ISP_RST_MS_DEF) || (rst_ms > ISP_RST_MS_MAX)) ? ISP_RST_MS_DEF : rst_ms;
+	isp_sck = (sck < ISP_SCK_N) ? sck : ISP_SCK_DEF;
+}
+
+// change SCK while connected
+void isp_sck_set(uint8_t sck)
+{
+	if( sck >= ISP_SCK_N ) return;
+	isp_wait();
+	isp_sck = sck;
+	spi_init(pgm_read_byte(&isp_sck_fdiv[isp_sck]));
+}
+
+// one rung back towards the defaults, so a hint that only ever got slower
+// recovers once the slow target is gone
+void isp_conn_relax(void)
+{
+	if( isp_rst_ms >= ISP_RST_MS_DEF + 10 ) isp_rst_ms -= 10;
+	if( isp_sck > ISP_SCK_DEF ) --isp_sck;
+}
+
+uint8_t isp_conn_rst_ms(void) { return isp_rst_ms; }
+uint8_t isp_conn_sck(void) { return isp_sck; }
+uint8_t isp_conn_tries(void) { return isp_tries; }
+
+// Tries the current reset hold and SCK first. An out of sync target is
+// resynced with SCK pulses, only then reset is cycled with a longer hold
+// and a slower SCK. Returns the number of programming enable attempts,
+// 0 if the target never answered.
 uint8_t isp_connect(void)
 {
-	uint8_t i = 16; // retries
-	uint8_t j = 1;
+	uint8_t i;
+
+	isp_wait();
+	isp_dev_default(); // the part is not known until its signature is checked
+	isp_tries = 0;
+
+	// timer 1 is free while not busy, it bounds the time an empty socket costs
+	TCNT1 = 0;
+	TCCR1B = 5; // prescaler 1024
 
-	while( --i ) {
+	for( i = 0; i < ISP_CONN_TRIES; ++i ) {
 		wdt_reset();
 		isp_trst(0);
-		_delay_ms(30);  // min 20 ms
-		if( isp_prgen() ) return 1;
+		uint8_t k = isp_rst_ms;
+		while( k-- ) _delay_ms(1);
+
+		uint8_t p;
+		for( p = 0; p < ISP_SYNC_PULSES; ++p ) {
+			++isp_tries;
+			if( isp_prgen() ) {
+				TCCR1B = 0;
+				trace(TRC_CONN, isp_tries);
+				return isp_tries;
+			}
+			isp_sck_pulse();
+		}
+
 		isp_trst(1);
-		uint8_t k = ++j; // progressively increase delay
-		while( --k ) _delay_ms(10);
+		_delay_ms(1);
+		if( isp_rst_ms + 10 <= ISP_RST_MS_MAX ) isp_rst_ms += 10;
+		if( isp_sck + 1 < ISP_SCK_N ) ++isp_sck;
+		trace(TRC_CONN_SLOW, isp_sck);
+		if( TCNT1 >= ISP_TMR_100US(ISP_CONN_TIME) ) break;
 	}
 
+	TCCR1B = 0;
+	trace(TRC_CONN, 0);
+	isp_tries = 0;
 	return 0;
 }
 
 void isp_disconnect(void)
 {
+	isp_wait();
+	isp_dev_default();
 	isp_trst(1);
 }
 
 uint32_t isp_dev_sig(void)
 {
+	isp_wait();
+
 	uint32_t r = isp_sigbyte(0);
 	r <<= 8;
 	r += isp_sigbyte(1);
@@ -128,17 +311,62 @@ uint32_t isp_dev_sig(void)
 	return r;
 }
 
+// device database lookup, returns 0 for unknown parts
+uint8_t isp_dev_find(uint32_t sig, struct isp_dev* d)
+{
+	if( (sig >> 16) != 0x1e ) return 0;
+
+	uint8_t i;
+	for( i = 0; i < sizeof(isp_devs)/sizeof(isp_devs[0]); ++i ) {
+		if( pgm_read_word(&isp_devs[i].sig) == (uint16_t)sig ) {
+			memcpy_P(d, &isp_devs[i], sizeof(*d));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// use the write times of sig from now on, worst case ones if it is unknown
+uint8_t isp_dev_use(uint32_t sig)
+{
+	struct isp_dev d;
+
+	isp_wait();
+
+	if( !isp_dev_find(sig, &d) ) {
+		isp_dev_default();
+		return 0;
+	}
+
+	isp_t_flash = d.twd_flash;
+	isp_t_ee = d.twd_ee;
+	isp_t_erase = d.twd_erase;
+	isp_rdybsy = d.flags & ISP_DEV_RDYBSY;
+	isp_eepg = d.eepgsize;
+	return 1;
+}
+
+uint8_t isp_ee_pgsize(void)
+{
+	return isp_eepg;
+}
+
 // NOTE: non null verify pointer performs verification instead of read
 void isp_flash_rd(uint32_t addr, uint8_t* pgdata, uint16_t pgsize, uint8_t* verify)
 {
 	if( verify ) *verify = 1;
 
+	isp_wait();
+
+	BENCH_BEGIN(BENCH_FLASH_VRF);
+
 	// load extended addr
 	isp_ext_addr(addr);
 
 	uint16_t i;
 	for( i = 0; i < pgsize; ++i ) {
-		if( i & 1 ) {
+		if( (addr+i) & 1 ) {
 			spi_rw(0x28);
 		} else {
 			spi_rw(0x20);
@@ -147,16 +375,22 @@ void isp_flash_rd(uint32_t addr, uint8_t* pgdata, uint16_t pgsize, uint8_t* veri
 		spi_rw((addr+i) >> 1);
 		uint8_t d = spi_rw(0);
 		if( verify ) {
-			if( *pgdata != d ) { *verify = 0; return; }
+			if( *pgdata != d ) { *verify = 0; break; }
 		} else {
 			*pgdata = d;
 		}
 		++pgdata;
 	}
+
+	BENCH_END(BENCH_FLASH_VRF);
 }
 
 void isp_flash_wr(uint32_t addr, uint8_t* pgdata, uint16_t pgsize)
 {
+	isp_wait();
+
+	BENCH_BEGIN(BENCH_FLASH_WR);
+
 	// fill page buffer
 	uint16_t i;
 	for( i = 0; i < pgsize; ++i ) {
@@ -179,39 +413,49 @@ void isp_flash_wr(uint32_t addr, uint8_t* pgdata, uint16_t pgsize)
 	spi_rw(addr >> 1);
 	spi_rw(0);
 
-	_delay_ms(ISP_FLASH_PAGE_DELAY_MS);
+	BENCH_END(BENCH_FLASH_WR);
+
+	isp_busy_for(isp_t_flash);
 }
 
 void isp_chip_erase(void)
 {
+	isp_wait();
+
 	spi_rw(0xac);
 	spi_rw(0x80);
 	spi_rw(0);
 	spi_rw(0);
 
-	_delay_ms(ISP_CHIP_ERASE_DELAY_MS);
+	isp_busy_for(isp_t_erase);
 }
 
 uint8_t isp_fuse_rd(uint8_t f)
 {
-	spi_rw(ISP_FUSE_RD_CMD[f&3][0]);
-	spi_rw(ISP_FUSE_RD_CMD[f&3][1]);
+	isp_wait();
+
+	spi_rw(pgm_read_byte(&ISP_FUSE_RD_CMD[f&3][0]));
+	spi_rw(pgm_read_byte(&ISP_FUSE_RD_CMD[f&3][1]));
 	spi_rw(0);
 	return spi_rw(0);
 }
 
 void isp_fuse_wr(uint8_t f, uint8_t data)
 {
+	isp_wait();
+
 	spi_rw(0xac);
-	spi_rw(ISP_FUSE_WR_CMD[f&3]);
+	spi_rw(pgm_read_byte(&ISP_FUSE_WR_CMD[f&3]));
 	spi_rw(0);
 	spi_rw(data);
 
-	_delay_ms(ISP_FUSE_WR_DELAY_MS);
+	isp_busy_for(ISP_FUSE_WR_DELAY);
 }
 
 uint8_t isp_ee_rd(uint16_t addr)
 {
+	isp_wait();
+
 	spi_rw(0xa0);
 	spi_rw(addr >> 8);
 	spi_rw(addr);
@@ -220,10 +464,36 @@ uint8_t isp_ee_rd(uint16_t addr)
 
 void isp_ee_wr(uint16_t addr, uint8_t data)
 {
+	isp_wait();
+
 	spi_rw(0xc0);
 	spi_rw(addr >> 8);
 	spi_rw(addr);
 	spi_rw(data);
 
-	_delay_ms(ISP_EE_WR_DELAY_MS);
+	isp_busy_for(isp_t_ee);
+}
+
+// EE page mode, bytes are loaded into the page buffer, only loaded ones are
+// written by isp_ee_pgwr
+void isp_ee_pgld(uint16_t addr, uint8_t data)
+{
+	isp_wait();
+
+	spi_rw(0xc1);
+	spi_rw(0);
+	spi_rw(addr & (isp_eepg - 1));
+	spi_rw(data);
+}
+
+void isp_ee_pgwr(uint16_t addr)
+{
+	isp_wait();
+
+	spi_rw(0xc2);
+	spi_rw(addr >> 8);
+	spi_rw(addr & ~(isp_eepg - 1));
+	spi_rw(0);
+
+	isp_busy_for(isp_t_ee);
 }
@@ -4,18 +4,47 @@
 #include <inttypes.h>
 
 void isp_init(void);
+void isp_wait(void);
+
+#define ISP_SCK_N 7 // SCK rungs F_CPU/2 .. F_CPU/128
+
+void isp_conn_set(uint8_t rst_ms, uint8_t sck);
+void isp_sck_set(uint8_t sck);
+void isp_conn_relax(void);
+uint8_t isp_conn_rst_ms(void);
+uint8_t isp_conn_sck(void);
+uint8_t isp_conn_tries(void);
 
 uint8_t isp_connect(void);
 void isp_disconnect(void);
 
 uint32_t isp_dev_sig(void);
 
+#define ISP_DEV_RDYBSY 0x01 // supports Poll RDY/BSY
+
+// device database entry, write times are the datasheet t_WD in 0.1 ms
+struct isp_dev {
+	uint16_t sig; // signature bytes 1 and 2, byte 0 is 0x1e
+	uint8_t pgwords; // flash page
+	uint8_t eepgsize; // EE page in bytes, 0 byte writes only
+	uint8_t flags;
+	uint8_t twd_flash;
+	uint8_t twd_ee;
+	uint8_t twd_erase;
+};
+
+uint8_t isp_dev_find(uint32_t sig, struct isp_dev* d);
+uint8_t isp_dev_use(uint32_t sig);
+uint8_t isp_ee_pgsize(void);
+
 void isp_chip_erase(void);
 void isp_flash_rd(uint32_t addr, uint8_t* pgdata, uint16_t pgsize, uint8_t* verify);
 void isp_flash_wr(uint32_t addr, uint8_t* pgdata, uint16_t pgsize);
 
 uint8_t isp_ee_rd(uint16_t addr);
 void isp_ee_wr(uint16_t addr, uint8_t data);
+void isp_ee_pgld(uint16_t addr, uint8_t data);
+void isp_ee_pgwr(uint16_t addr);
 
 #define ISP_LFUSE 0
 #define ISP_HFUSE 1
@@ -40,6 +40,7 @@ AVR isp bub
 #include <avr/eeprom.h>
 #include <util/delay.h>
 #include <util/crc16.h>
+#include <util/atomic.h>
 
 #include "mat/spi.h"
 #include "mat/i2c.h"
@@ -49,6 +50,8 @@ AVR isp bub
 #include "swdefs.h"
 #include "isp.h"
 #include "ee_24.h"
+#include "bench.h"
+#include "trace.h"
 
 // ----------------------------------------------------------------------------
 // DEFINES
@@ -60,11 +63,102 @@ AVR isp bub
 	#define AT_CMD_BAUD BAUD_4800
 #elif F_CPU == 8000000
 	#define AT_CMD_BAUD BAUD_38400
+#elif F_CPU == 16000000
+	#define AT_CMD_BAUD BAUD_57600
+#elif F_CPU == 20000000
+	#define AT_CMD_BAUD BAUD_115200
+#else
+	#error "no AT_CMD_BAUD for this F_CPU"
 #endif
 
-#define BUFSIZE 128
+// timer 0 ticks at approx 64 Hz, above 16.7 MHz a tick takes two overflows
+#if F_CPU / 0x10000 > 0xff
+	#define TMR0_OVFS 2
+#else
+	#define TMR0_OVFS 1
+#endif
+
+#define TMR0_RELOAD (0x100 - (F_CPU / 0x10000 / TMR0_OVFS))
+
+#if RAMEND >= 0x8FF // 2k SRAM parts (ATmega328P)
+	#define BUFSIZE 256
+	#define RXBUFSIZE 128
+	#define TXBUFSIZE 64
+#else
+	#define BUFSIZE 128
+	#if F_CPU == 20000000 // 115200 baud, holds what arrives during a 24C512 page write
+		#define RXBUFSIZE 128
+	#else
+		#define RXBUFSIZE 64
+	#endif
+	#define TXBUFSIZE 32
+#endif
+
+#define PGBUFSIZE 256
+
+// --- RAM arena partitioning ---
+//
+// command: atbuf (store bitmap in its tail) | wbuf | rbuf
+// program: pgbuf0 | pgbuf1 | atbuf (short, for status commands)
+//
+// uploads go through the command layout
+
+#define ATBUFSIZE (2*BUFSIZE+16)
+#define ARENASIZE (ATBUFSIZE+2*BUFSIZE)
+
+#if 2*PGBUFSIZE+16 > ARENASIZE
+	#error "page buffers do not fit the arena"
+#endif
+
+// the other globals and the stack need what the big buffers leave, make ramcheck
+// checks the linked total
+#define RAMSIZE ((RAMEND >= 0x8FF) ? 2048 : 1024)
+#define RAM_RESERVE 320
+
+#if ARENASIZE+RXBUFSIZE+TXBUFSIZE+TRACE_N*TRACE_ENTRY_SIZE+RAM_RESERVE > RAMSIZE
+	#error "buffers leave too little RAM, reduce TRACE_N"
+#endif
+
+#define ARENA_CMD 0
+#define ARENA_PRG 1
+
+// --- programming phases ---
+
+#define TGT_IDLE 0
+#define TGT_CONNECT 1
+#define TGT_ERASE 2
+#define TGT_FLASH 3
+#define TGT_EE 4
+#define TGT_FUSE 5
+#define TGT_CMP 6 // smart mode flash compare
+#define TGT_VRF 7 // deferred flash verify
+#define TGT_RCP 8 // next recipe op
+
+// --- recipe ops, words are little endian ---
+
+#define RCP_END 0x00 // also 0xff
+#define RCP_ERASE 0x01
+#define RCP_FLASH 0x02 // src, dst, len (words), dst on a page boundary
+#define RCP_EE 0x03 // src, dst, len (words)
+#define RCP_FUSE 0x04 // fuse (ISP_LFUSE..ISP_LOCK), value
+#define RCP_VERIFY 0x05 // read back the last flash region
+#define RCP_SCK 0x06 // SCK rung 0..6
+#define RCP_RECONNECT 0x07 // reset the target, e.g. for new clock fuses
+
+// --- flash verify policy ---
+
+#define VRF_OFF 0
+#define VRF_INLINE 1 // read back every page right after it is written
+#define VRF_DEFERRED 2 // one pass after all pages are written
+#define VRF_SAMPLED 3 // inline, but only every 8th and the last page
+#define VRF_SAMPLE_MASK 7
+
+#define TGT_RUN 0xff // tgt_step result while still running
+
+#define CONN_RELAX_N 8 // first attempt connects in a row before the stored timing is relaxed
 
 #define BTN_THRE 25
+#define BTN_LONG 128 // approx 2 s
 
 // --- internal EEPROM address allocation ---
 
@@ -79,33 +173,148 @@ AVR isp bub
 #define EEWA_EE_OFFS 16 // word
 #define EEWA_EE_SIZE 18 // word
 
+#define EEDA_SMART 20 // byte
+#define EEDA_VRF 21 // byte
+#define EEDA_CONN_RST 22 // byte, reset hold in ms that last worked
+#define EEDA_CONN_SCK 23 // byte, SCK rung that last worked
+
+#define EEDA_SERIAL 24 // dword, next serial number
+#define EEDA_SERIAL_LAST 28 // dword, last one programmed
+
+#define EEDA_PATCH 32 // PATCH_N entries of PATCH_SIZE bytes: mem, fmt, width, -, addr dword
+#define PATCH_N 4
+#define PATCH_SIZE 8
+
+#define EEDA_SLOT 64 // byte, active 24C512 slot (anything but 1 is slot 0)
+#define EEWA_SLOT_LEN 65 // word per slot, image length at the last swap
+#define EEWA_SLOT_CRC 69 // word per slot, image CRC at the last swap
+
+#define EEWA_RECIPE 73 // word, recipe offset in the slot, 0xffff none
+
+#define EEDA_STORE 75 // byte, 1: the 24C512 holds a block store instead of plain slots
+#define EEDA_HANDLER 76 // byte, handler start input: 1 programs, 2 verifies, else off
+
+// Programming parameters of the image in each slot. AT+ISPTARGET sets the
+// ones above for the next image, AT+EE24SWAP copies them into the record of
+// the slot it activates, so image and parameters switch together.
+#define EEDA_PRM(slot) (80 + (slot)*16) // 16 bytes per slot
+#define PRM_FW_SIZE 0 // word
+#define PRM_EE_OFFS 2 // word
+#define PRM_EE_SIZE 4 // word
+#define PRM_XFUSE 6 // dword
+#define PRM_XFUSE_PRG 10 // dword
+#define PRM_RECIPE 14 // word
+#define PRM_SIZE 16
+#define PRM_ADR(slot, ofs) (EEDA_PRM(slot) + (ofs))
+
+// the 24C512 holds two image slots, uploads go to the inactive one
+#define EE24_SLOT_SIZE 0x8000
+#define EE24_PAGE 128 // a page write wraps around inside this
+
+// Block store format: a slot is a map of block numbers, one per STORE_BLK
+// bytes of the image, 0xffff for a block of 0xff. Blocks are shared between
+// the slots and written only once. The host keeps a hash of every block in
+// the index to find them again and decides which blocks are free.
+#define STORE_BLK 128
+#define STORE_MAP(slot) ((slot) ? 0x0200 : 0x0000) // 256 words each
+#define STORE_MAPSIZE 0x0200
+#define STORE_IDX 0x0400 // 4 bytes per block, written by the host only
+#define STORE_POOL 0x0c00 // first block, blocks 24..511
+
+// Bit per block the active map refers to. It borrows the tail of atbuf, upload
+// lines are shorter, a line that reaches it or a switch of the arena layout
+// only costs a rescan.
+#define STORE_REFSIZE (0x10000/STORE_BLK/8)
+#define STORE_REF (arena + ATBUFSIZE - STORE_REFSIZE)
+
 // ----------------------------------------------------------------------------
 // GLOBAL VARIABLES
 // ----------------------------------------------------------------------------
 
-uint8_t rxbuf[16];
-uint8_t txbuf[8];
+uint8_t rxbuf[RXBUFSIZE];
+uint8_t txbuf[TXBUFSIZE];
 
 volatile uint8_t blink = 0;
 volatile uint8_t btn_pressed = 0;
+volatile uint8_t btn_long = 0;
+
+volatile uint8_t hnd_mode = 0;
+volatile uint8_t hnd_start = 0;
 
 static uint8_t at_echo = 0;
 
-static uint8_t buf1[BUFSIZE];
-static uint8_t buf2[BUFSIZE];
+static uint8_t arena[ARENASIZE];
 
-static uint8_t* wbuf = buf1;
+static uint8_t* wbuf;
 static uint16_t wlen = 0;
 
-static uint8_t* rbuf = buf2;
+static uint8_t* rbuf;
 static uint16_t rlen = 0;
 
 static uint8_t bufdisp = 1;
 
-static uint8_t atbuf[2*BUFSIZE+16];
+static uint8_t* atbuf;
+static uint16_t atbufsize;
 static uint16_t atbuflen = 0;
 
-const char* fuse_name[] = {"lfuse","hfuse","efuse","lock"};
+static uint8_t* pgbuf[2];
+
+#ifdef BENCH
+uint8_t bench_sel = 0;
+#endif
+
+static uint8_t strm_on = 0;
+static uint8_t strm_pend = 0;
+static uint32_t strm_adr;
+
+// AT+EE24UP chunk in rbuf
+#define UP_IDLE 0
+#define UP_COMMIT 1 // to be written to the 24C512
+#define UP_VERIFY 2 // written, to be read back
+#define UP_FAIL 3
+static uint8_t up_state = UP_IDLE;
+static uint16_t up_adr;
+
+static uint8_t tgt_phase = TGT_IDLE;
+static uint8_t tgt_result = TGT_RUN;
+static uint16_t tgt_pgsize;
+static uint16_t tgt_fwsize;
+static uint16_t tgt_eesize;
+static uint32_t tgt_adr;
+static uint16_t tgt_pos;
+static uint8_t* tgt_pg;
+static uint8_t* tgt_nx;
+static uint8_t tgt_retr;
+static uint8_t tgt_oldf;
+static uint8_t tgt_vonly; // verify only, never write to the target
+static uint8_t tgt_smart; // skip what already matches
+static uint8_t tgt_vrf; // VRF_...
+static uint32_t tgt_serial; // value patched into this unit
+static uint8_t tgt_slot; // slot being programmed
+static uint8_t tgt_conn_ok; // connects in a row that needed one attempt
+static uint16_t img_map = 0xffff; // map entry cached in img_blk
+static uint16_t img_blk;
+static uint8_t store_ok; // STORE_REF is current
+static uint8_t tgt_patched;
+static uint8_t tgt_traced; // phase last put in the trace
+static uint16_t tgt_rcp; // next recipe op in the slot, 0xffff no recipe
+static uint16_t tgt_dst; // start of the flash region
+static uint16_t tgt_srcoff; // image offset minus flash address of the region
+static uint16_t tgt_eesrc; // image offset of the EE region
+static uint16_t tgt_eedst; // EE address of the EE region
+static uint8_t tgt_fval; // recipe fuse value
+
+const char fuse_name[][6] PROGMEM = {"lfuse","hfuse","efuse","lock"};
+const char phase_name[][8] PROGMEM = {"idle","connect","erase","flash","ee","fuse","compare","verify","recipe"};
+const char vrf_name[][9] PROGMEM = {"off","inline","deferred","sampled"};
+
+// where each byte of a slot parameter record comes from
+const uint8_t prm_src[PRM_SIZE] PROGMEM = {
+	EEWA_FW_SIZE, EEWA_FW_SIZE+1, EEWA_EE_OFFS, EEWA_EE_OFFS+1, EEWA_EE_SIZE, EEWA_EE_SIZE+1,
+	EEDA_XFUSE, EEDA_XFUSE+1, EEDA_XFUSE+2, EEDA_XFUSE+3,
+	EEDA_XFUSE_PRG, EEDA_XFUSE_PRG+1, EEDA_XFUSE_PRG+2, EEDA_XFUSE_PRG+3,
+	EEWA_RECIPE, EEWA_RECIPE+1
+};
 
 // ----------------------------------------------------------------------------
 // AT commands
@@ -120,6 +329,10 @@ const char atbufrddisp[]  PROGMEM = "AT+BUFRDDISP="; // 0,1
 const char atee24rd[]     PROGMEM = "AT+EE24RD="; // aaaaaa,len
 const char atee24wr[]     PROGMEM = "AT+EE24WR="; // aaaaaa
 const char atee24crc[]    PROGMEM = "AT+EE24CRC="; // len
+const char atee24up[]     PROGMEM = "AT+EE24UP="; // aaaaaa,data
+const char atee24swap[]   PROGMEM = "AT+EE24SWAP="; // len,crc
+const char atee24slot[]   PROGMEM = "AT+EE24SLOT";
+const char atee24format[] PROGMEM = "AT+EE24FORMAT="; // 0,1,?
 const char atisptarget[]  PROGMEM = "AT+ISPTARGET="; // ...
 const char atispcon[]     PROGMEM = "AT+ISPCON";
 const char atispdis[]     PROGMEM = "AT+ISPDIS";
@@ -132,12 +345,35 @@ const char atispfusewr[]  PROGMEM = "AT+ISPFUSEWR="; // dd,f
 const char atispeerd[]    PROGMEM = "AT+ISPEERD="; // aaaaaa,len
 const char atispeewr[]    PROGMEM = "AT+ISPEEWR="; // aaaaaa
 const char atispprogram[] PROGMEM = "AT+ISPPROGRAM";
+const char atispverify[]  PROGMEM = "AT+ISPVERIFY";
+const char atispsmart[]   PROGMEM = "AT+ISPSMART="; // 0,1,?
+const char atispvrf[]     PROGMEM = "AT+ISPVRF="; // 0..3,?
+const char atisprecipe[]  PROGMEM = "AT+ISPRECIPE="; // aaaa,-
+const char atispsck[]     PROGMEM = "AT+ISPSCK="; // 0..6,?
+const char atispserial[]  PROGMEM = "AT+ISPSERIAL="; // n,?
+const char atisphandler[] PROGMEM = "AT+ISPHANDLER="; // 0,1,2,?
+const char atisppatch[]   PROGMEM = "AT+ISPPATCH="; // n,m,f,w,aaaaaa  n,-  ?
+const char atispstrbeg[]  PROGMEM = "AT+ISPSTRBEG";
+const char atispstrpg[]   PROGMEM = "AT+ISPSTRPG="; // aaaaaa
+const char atispstrend[]  PROGMEM = "AT+ISPSTREND";
+const char atispstat[]    PROGMEM = "AT+ISPSTAT";
+const char atispabort[]   PROGMEM = "AT+ISPABORT";
+const char attrace[]      PROGMEM = "AT+TRACE";
+const char attraceclr[]   PROGMEM = "AT+TRACECLR";
+#ifdef BENCH
+const char atbench[]      PROGMEM = "AT+BENCH="; // n
+#endif
 
-PGM_P atcommands[] = {
+PGM_P const atcommands[] PROGMEM = {
 	atbufwr,atbufrd,atbufrdlen,atbufswap,atbufcmp,atbufrddisp,
-	atee24rd,atee24wr,atee24crc,
+	atee24rd,atee24wr,atee24up,atee24crc,atee24swap,atee24slot,atee24format,
 	atisptarget,atispcon,atispdis,atispsig,atisperase,atispflsrd,atispflswr,
-	atispfuserd,atispfusewr,atispeerd,atispeewr,atispprogram
+	atispfuserd,atispfusewr,atispeerd,atispeewr,atispprogram,atispverify,atispsmart,atispvrf,atisprecipe,atispsck,atispserial,atisphandler,atisppatch,
+	atispstrbeg,atispstrpg,atispstrend,atispstat,atispabort,
+	attrace,attraceclr
+#ifdef BENCH
+	,atbench
+#endif
 };
 
 // ----------------------------------------------------------------------------
@@ -152,8 +388,71 @@ void btn_init(void)
 
 void tmr0_init(void)
 {
+#ifdef TCCR0B // ATmega88/168/328P
+	TCCR0B = 5; // prescaler 1024
+	TIMSK0 |= _BV(TOIE0);
+#else
 	TCCR0 = 5; // prescaler 1024
 	TIMSK |= _BV(TOIE0);
+#endif
+}
+
+// --- handler interface ------------------------------------------------------
+//
+// A falling edge on the start input (INT0) is latched by its ISR, which also
+// raises BUSY at once, and the run starts on the next main loop pass instead
+// of waiting for the polled button debounce. The input is rearmed by the
+// timer ISR once it has been released for HND_REARM ticks. BUSY is high
+// during a run, PASS or FAIL from its end until the next start.
+
+#ifdef EIMSK // ATmega88/168/328P
+	#define HND_INT_CTRL EICRA
+	#define HND_INT_MASK EIMSK
+	#define HND_INT_FLAGS EIFR
+#else
+	#define HND_INT_CTRL MCUCR
+	#define HND_INT_MASK GICR
+	#define HND_INT_FLAGS GIFR
+#endif
+
+#define HND_OUTS (_BV(HND_BUSY_BIT)|_BV(HND_PASS_BIT)|_BV(HND_FAIL_BIT))
+#define HND_REARM 2 // approx 30 ms
+
+void hnd_init(void)
+{
+	HND_INT_MASK &= ~_BV(INT0);
+	hnd_start = 0;
+
+	hnd_mode = eeprom_read_byte((uint8_t*)EEDA_HANDLER);
+	if( (hnd_mode != 1) && (hnd_mode != 2) ) hnd_mode = 0;
+
+	if( hnd_mode ) {
+		HND_PORT &= ~HND_OUTS;
+		DDR(HND_PORT) |= HND_OUTS;
+		DDR(HND_PORT) &= ~_BV(HND_START_BIT);
+		HND_PORT |= _BV(HND_START_BIT); // pull-up, the handler pulls it low
+		HND_INT_CTRL = (HND_INT_CTRL & ~(_BV(ISC01)|_BV(ISC00))) | _BV(ISC01); // falling edge
+		HND_INT_FLAGS = _BV(INTF0);
+		HND_INT_MASK |= _BV(INT0);
+	} else {
+		DDR(HND_PORT) &= ~HND_OUTS;
+		HND_PORT &= ~(HND_OUTS | _BV(HND_START_BIT)); // no pull-ups on the released pins
+	}
+}
+
+// TGT_RUN is busy, else the result code
+void hnd_out(uint8_t ec)
+{
+	if( !hnd_mode ) return;
+
+	uint8_t b;
+	if( ec == TGT_RUN ) b = _BV(HND_BUSY_BIT);
+	else b = (ec == 0) ? _BV(HND_PASS_BIT) : _BV(HND_FAIL_BIT);
+
+	// the port is shared with TRST and the INT0 ISR writes BUSY
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		HND_PORT = (HND_PORT & ~HND_OUTS) | b; // all three change at once
+	}
 }
 
 void ser_endl(uint8_t n)
@@ -237,22 +536,238 @@ uint8_t bufofval(uint8_t* buf, uint16_t buflen, uint8_t val)
 	return 1;
 }
 
-uint16_t ee24_crc(uint32_t adr, uint16_t len)
+// ee24_rd for blocks that don't fit its 8 bit length
+uint8_t ee24_rdblk(uint16_t adr, uint8_t* buf, uint16_t len)
+{
+	while( len ) {
+		uint8_t n = (len > 128) ? 128 : len;
+		if( ee24_rd(adr, buf, n) ) {
+			trace(TRC_EE24_ERR, adr >> 8);
+			return 1;
+		}
+		adr += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// switching layouts discards whatever the previous one held
+void arena_use(uint8_t mode)
+{
+	if( mode == ARENA_PRG ) {
+		pgbuf[0] = arena;
+		pgbuf[1] = arena + PGBUFSIZE;
+		atbuf = arena + 2*PGBUFSIZE;
+		atbufsize = ARENASIZE - 2*PGBUFSIZE;
+	} else {
+		atbuf = arena;
+		atbufsize = ATBUFSIZE;
+		wbuf = arena + ATBUFSIZE;
+		rbuf = wbuf + BUFSIZE;
+	}
+
+	atbuflen = 0;
+	wlen = 0;
+	rlen = 0;
+	if( up_state != UP_FAIL ) up_state = UP_IDLE; // see ee24_up_flush()
+	store_ok = 0;
+}
+
+uint8_t ee24_slot(void)
+{
+	return eeprom_read_byte((uint8_t*)EEDA_SLOT) == 1;
+}
+
+// compare the parameters set with AT+ISPTARGET with the record of slot and
+// copy them when wr is set, returns non zero when they differ
+uint8_t prm_stage(uint8_t slot, uint8_t wr)
+{
+	uint8_t* p = (uint8_t*)EEDA_PRM(slot);
+	uint8_t i, d = 0;
+
+	for( i = 0; i < PRM_SIZE; ++i ) {
+		uint8_t v = eeprom_read_byte((uint8_t*)(uint16_t)pgm_read_byte(prm_src+i));
+		if( v == eeprom_read_byte(p+i) ) continue;
+		d = 1;
+		if( wr ) eeprom_update_byte(p+i, v);
+	}
+
+	return d;
+}
+
+uint8_t ee24_store(void)
+{
+	return eeprom_read_byte((uint8_t*)EEDA_STORE) == 1;
+}
+
+// uploads, readback and CRC of AT+EE24... address the inactive slot, in
+// the block store the whole 24C512
+uint16_t ee24_upbase(void)
+{
+	if( ee24_store() ) return 0;
+	return ee24_slot() ? 0 : EE24_SLOT_SIZE;
+}
+
+uint32_t ee24_uplimit(void)
+{
+	return ee24_store() ? 0x10000 : EE24_SLOT_SIZE;
+}
+
+// Marks the pool blocks the map of the active slot refers to. The map only
+// changes with a swap or a format, these and anything that reuses the tail of
+// atbuf clear store_ok and the next upload command scans again. A map that
+// can't be read protects the whole pool and is scanned again next time.
+void store_scan(void)
+{
+	memset(STORE_REF, 0, STORE_REFSIZE);
+	store_ok = 1;
+
+	uint8_t s = ee24_slot();
+	uint16_t n = (eeprom_read_word((uint16_t*)EEWA_SLOT_LEN+s) + STORE_BLK - 1) / STORE_BLK;
+	uint8_t e[16];
+	uint16_t i;
+	for( i = 0; i < n; ++i ) {
+		uint8_t k = (i * 2) % sizeof(e);
+		if( (k == 0) && ee24_rdblk(STORE_MAP(s) + i*2, e, sizeof(e)) ) {
+			trace(TRC_EE24_ERR, STORE_MAP(s) >> 8);
+			memset(STORE_REF, 0xff, STORE_REFSIZE);
+			store_ok = 0;
+			return;
+		}
+		uint16_t b = e[k] | (e[k+1] << 8);
+		if( b < 0x10000/STORE_BLK ) STORE_REF[b/8] |= _BV(b%8);
+	}
+}
+
+// writes must stay off the map of the active slot and the blocks it uses
+uint8_t ee24_up_bad(uint32_t adr, uint16_t len)
+{
+	if( adr + len > ee24_uplimit() ) return 1;
+	if( !ee24_store() || (len == 0) ) return 0;
+	uint16_t m = STORE_MAP(ee24_slot());
+	if( (adr < m + STORE_MAPSIZE) && (adr + len > m) ) return 1;
+
+	if( !store_ok ) store_scan();
+	uint16_t b = ((adr < STORE_POOL) ? STORE_POOL : adr) / STORE_BLK;
+	for( ; b <= (adr + len - 1) / STORE_BLK; ++b ) {
+		if( STORE_REF[b/8] & _BV(b%8) ) return 1;
+	}
+	return 0;
+}
+
+// image bytes of a slot, through the block map in the block store
+uint8_t img_rd(uint8_t slot, uint16_t off, uint8_t* buf, uint16_t len)
+{
+	if( !ee24_store() ) return ee24_rdblk((slot ? EE24_SLOT_SIZE : 0) + off, buf, len);
+
+	while( len ) {
+		uint16_t m = STORE_MAP(slot) + (off / STORE_BLK) * 2;
+		if( m != img_map ) {
+			uint8_t e[2];
+			if( ee24_rd(m, e, 2) ) {
+				trace(TRC_EE24_ERR, m >> 8);
+				return 1;
+			}
+			img_map = m;
+			img_blk = e[0] | (e[1] << 8);
+		}
+
+		uint8_t k = off % STORE_BLK;
+		uint16_t n = STORE_BLK - k;
+		if( n > len ) n = len;
+
+		if( img_blk == 0xffff ) {
+			memset(buf, 0xff, n);
+		} else {
+			if( (img_blk < STORE_POOL / STORE_BLK) || (img_blk >= 0x10000 / STORE_BLK) ) return 1;
+			if( ee24_rdblk(img_blk * STORE_BLK + k, buf, n) ) return 1;
+		}
+
+		off += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+uint8_t tgt_img_rd(uint16_t off, uint8_t* buf, uint16_t len)
+{
+	return img_rd(tgt_slot, off, buf, len);
+}
+
+// --- overlapped upload ---
+//
+// AT+EE24UP is acknowledged as soon as its data is decoded. The chunk is
+// written from rbuf by the main loop while the host sends the next one and
+// read back when the next one (or AT+EE24CRC) arrives, by then the write
+// cycle is over. The main loop only starts the write between lines, a line
+// that has begun meanwhile commits it when it is complete.
+
+void ee24_up_commit(void)
+{
+	up_state = ee24_wr(up_adr, rbuf, rlen) ? UP_FAIL : UP_VERIFY;
+}
+
+// write and read back the chunk of the previous AT+EE24UP, leaves UP_IDLE or UP_FAIL
+void ee24_up_flush(void)
+{
+	if( up_state == UP_COMMIT ) ee24_up_commit();
+
+	if( up_state == UP_VERIFY ) {
+		uint8_t buf[16];
+		uint16_t i;
+		for( i = 0; i < rlen; i += sizeof(buf) ) {
+			uint8_t n = (rlen - i < sizeof(buf)) ? rlen - i : sizeof(buf);
+			if( ee24_rd(up_adr+i, buf, n) || memcmp(buf, rbuf+i, n) ) {
+				up_state = UP_FAIL;
+				break;
+			}
+		}
+	}
+
+	if( up_state != UP_FAIL ) up_state = UP_IDLE;
+}
+
+// verify the chunk of the previous AT+EE24UP
+uint8_t ee24_up_check(void)
+{
+	ee24_up_flush();
+
+	if( up_state == UP_FAIL ) {
+		up_state = UP_IDLE;
+		ser_puts_P(AT_CMD_UART, PSTR("ERR: EE24 verify failed "));
+		ser_puti_lc(AT_CMD_UART, up_adr - ee24_upbase(), 16, 6, '0');
+		ser_endl(AT_CMD_UART);
+		return 1;
+	}
+
+	return 0;
+}
+
+uint16_t ee24_crc(uint8_t slot, uint16_t len)
 {
 	uint16_t crc = 0;
 	uint16_t i;
 	uint8_t buf[16];
 
+	img_map = 0xffff; // the map may have been written since
+
+	BENCH_BEGIN(BENCH_EE24_CRC);
+
 	for( i = 0; i < len; ++i) {
 		wdt_reset();
 
 		if( (i & 0x0f) == 0 ) {
-			ee24_rd(adr+i, buf, sizeof(buf));
+			img_rd(slot, i, buf, sizeof(buf));
 		}
 
 		crc = _crc_xmodem_update(crc, buf[i & 0x0f]);
 	}
 
+	BENCH_END(BENCH_EE24_CRC);
+
 	return crc;
 }
 
@@ -260,8 +775,16 @@ uint16_t ee24_crc(uint32_t adr, uint16_t len)
 // Target functions
 // ----------------------------------------------------------------------------
 
+uint8_t tgt_vrf_mode(void)
+{
+	uint8_t v = eeprom_read_byte((uint8_t*)EEDA_VRF);
+	return (v > VRF_SAMPLED) ? VRF_INLINE : v; // inline when never set
+}
+
 void tgt_info(void)
 {
+	uint8_t f;
+
 	ser_puts_P(AT_CMD_UART, PSTR("sig "));
 	ser_puti_lc(AT_CMD_UART, eeprom_read_dword((uint32_t*)EEDA_SIG), 16, 6, '0');
 	ser_endl(AT_CMD_UART);
@@ -270,45 +793,120 @@ void tgt_info(void)
 	ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_PG_SIZE), 10);
 	ser_endl(AT_CMD_UART);
 
+	// write times from the device database, flash/EE/erase in ms
+	struct isp_dev dev;
+	if( isp_dev_find(eeprom_read_dword((uint32_t*)EEDA_SIG), &dev) ) {
+		uint8_t t[3] = {dev.twd_flash, dev.twd_ee, dev.twd_erase};
+		ser_puts_P(AT_CMD_UART, PSTR("twd "));
+		for( f = 0; f < 3; ++f ) {
+			if( f ) ser_putc(AT_CMD_UART, '/');
+			ser_puti(AT_CMD_UART, t[f] / 10, 10);
+			ser_putc(AT_CMD_UART, '.');
+			ser_puti(AT_CMD_UART, t[f] % 10, 10);
+		}
+		ser_endl(AT_CMD_UART);
+		ser_puts_P(AT_CMD_UART, PSTR("eepage "));
+		ser_puti(AT_CMD_UART, dev.eepgsize, 10);
+		ser_endl(AT_CMD_UART);
+		if( dev.flags & ISP_DEV_RDYBSY ) ser_puts_P(AT_CMD_UART, PSTR("rdybsy 1\r\n"));
+	} else {
+		ser_puts_P(AT_CMD_UART, PSTR("twd default\r\n"));
+	}
+
+	// the image specific ones come from the record of the active slot
+	uint8_t n = ee24_slot();
+
 	ser_puts_P(AT_CMD_UART, PSTR("fwsize "));
-	ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_FW_SIZE), 10);
+	ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)PRM_ADR(n, PRM_FW_SIZE)), 10);
 	ser_endl(AT_CMD_UART);
 
-	uint8_t f;
 	for( f = 0; f < 4; ++f ) {
-		if( eeprom_read_byte((uint8_t*)(EEDA_XFUSE_PRG+f)) == 1 ) {
-			ser_puts(AT_CMD_UART, fuse_name[f]);
+		if( eeprom_read_byte((uint8_t*)PRM_ADR(n, PRM_XFUSE_PRG+f)) == 1 ) {
+			ser_puts_P(AT_CMD_UART, fuse_name[f]);
 			ser_putc(AT_CMD_UART, ' ');
-			ser_puti_lc(AT_CMD_UART, eeprom_read_byte((uint8_t*)(EEDA_XFUSE+f)), 16, 2, '0');
+			ser_puti_lc(AT_CMD_UART, eeprom_read_byte((uint8_t*)PRM_ADR(n, PRM_XFUSE+f)), 16, 2, '0');
 			ser_endl(AT_CMD_UART);
 		}
 	}
 
-	if( eeprom_read_word((uint16_t*)EEWA_EE_SIZE) ) {
+	if( eeprom_read_word((uint16_t*)PRM_ADR(n, PRM_EE_SIZE)) ) {
 		ser_puts_P(AT_CMD_UART, PSTR("eeoffs 0x"));
-		ser_puti_lc(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_EE_OFFS), 16, 4, '0');
+		ser_puti_lc(AT_CMD_UART, eeprom_read_word((uint16_t*)PRM_ADR(n, PRM_EE_OFFS)), 16, 4, '0');
 		ser_endl(AT_CMD_UART);
 		ser_puts_P(AT_CMD_UART, PSTR("eesize "));
-		ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_EE_SIZE), 10);
+		ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)PRM_ADR(n, PRM_EE_SIZE)), 10);
+		ser_endl(AT_CMD_UART);
+	}
+
+	if( prm_stage(n, 0) ) {
+		ser_puts_P(AT_CMD_UART, PSTR("new parameters wait for AT+EE24SWAP\r\n"));
+	}
+
+	if( eeprom_read_byte((uint8_t*)EEDA_SMART) == 1 ) {
+		ser_puts_P(AT_CMD_UART, PSTR("smart 1\r\n"));
+	}
+
+	ser_puts_P(AT_CMD_UART, PSTR("verify "));
+	ser_puts_P(AT_CMD_UART, vrf_name[tgt_vrf_mode()]);
+	ser_endl(AT_CMD_UART);
+
+	ser_puts_P(AT_CMD_UART, PSTR("slot "));
+	ser_putc(AT_CMD_UART, 'A' + n);
+	ser_endl(AT_CMD_UART);
+
+	uint16_t r = eeprom_read_word((uint16_t*)PRM_ADR(n, PRM_RECIPE));
+	if( r != 0xffff ) {
+		ser_puts_P(AT_CMD_UART, PSTR("recipe 0x"));
+		ser_puti_lc(AT_CMD_UART, r, 16, 4, '0');
 		ser_endl(AT_CMD_UART);
 	}
 }
 
-uint8_t tgt_prog_try(void)
+void tgt_conn_load(void)
+{
+	isp_conn_set(eeprom_read_byte((uint8_t*)EEDA_CONN_RST), eeprom_read_byte((uint8_t*)EEDA_CONN_SCK));
+}
+
+// remember the timing that worked when it differs from the stored one
+void tgt_conn_save(void)
+{
+	if( (isp_conn_rst_ms() != eeprom_read_byte((uint8_t*)EEDA_CONN_RST)) ||
+	    (isp_conn_sck() != eeprom_read_byte((uint8_t*)EEDA_CONN_SCK)) ) {
+		eeprom_update_byte((uint8_t*)EEDA_CONN_RST, isp_conn_rst_ms());
+		eeprom_update_byte((uint8_t*)EEDA_CONN_SCK, isp_conn_sck());
+	}
+
+	ser_puts_P(AT_CMD_UART, PSTR("Connected, attempts "));
+	ser_puti(AT_CMD_UART, isp_conn_tries(), 10);
+	ser_endl(AT_CMD_UART);
+}
+
+// connect to target and check it is the one we expect
+uint8_t tgt_open(uint16_t maxpg)
 {
 	// page size check
 	uint16_t pgsize = eeprom_read_word((uint16_t*)EEWA_PG_SIZE);
-	if( (pgsize == 0) || (sizeof(atbuf) < pgsize) ) {
+	if( (pgsize == 0) || (maxpg < pgsize) ) {
 		ser_puts_P(AT_CMD_UART, PSTR("ERR: Invalid page size\r\n"));
 		return 1;
 	}
 
-	// connect to target
+	// connect to target with what worked last time, one rung faster only
+	// after a row of boards that all answered the first attempt
 	ser_puts_P(AT_CMD_UART, PSTR("Connecting...\r\n"));
+	tgt_conn_load();
+	if( tgt_conn_ok >= CONN_RELAX_N ) {
+		tgt_conn_ok = 0;
+		isp_conn_relax();
+	}
 	if( !isp_connect() ) {
+		tgt_conn_load(); // an empty socket says nothing about the next board
 		ser_puts_P(AT_CMD_UART, PSTR("ERR: Device not responding\r\n"));
 		return 2;
 	}
+	if( isp_conn_tries() == 1 ) ++tgt_conn_ok;
+	else tgt_conn_ok = 0;
+	tgt_conn_save();
 
 	// check device signature
 	uint32_t sig = isp_dev_sig();
@@ -318,96 +916,664 @@ uint8_t tgt_prog_try(void)
 		ser_endl(AT_CMD_UART);
 		return 3;
 	}
+	isp_dev_use(sig);
 
-	// program flash
-	uint32_t fwsize = eeprom_read_word((uint16_t*)EEWA_FW_SIZE);
-	if( fwsize ) {
-		ser_puts_P(AT_CMD_UART, PSTR("Erasing...\r\n"));
-		isp_chip_erase();
-		ser_puts_P(AT_CMD_UART, PSTR("Programming flash...\r\n"));
-		atbuflen = 0; // since atbuf will be hijacked for flash programming, clear atbuflen
-		uint32_t adr = 0;
-		while( adr < fwsize ) {
-			wdt_reset();
-			ser_puti_lc(AT_CMD_UART, adr, 16, 6, '0');
+	return 0;
+}
+
+// --- per unit patches -------------------------------------------------------
+//
+// Each entry puts the serial number at a flash (F) or EE (E) address as
+// little endian (L), big endian (B), decimal ASCII (D) or hex ASCII (H), in
+// width bytes. The number advances after each successful run.
+
+// byte k of the serial formatted as fmt, width w
+uint8_t patch_byte(uint8_t fmt, uint8_t w, uint8_t k)
+{
+	uint32_t v = tgt_serial;
+
+	if( fmt == 'L' ) return (k < 4) ? v >> (8*k) : 0;
+
+	k = w - 1 - k; // from the right
+	if( fmt == 'B' ) return (k < 4) ? v >> (8*k) : 0;
+
+	uint8_t base = (fmt == 'H') ? 16 : 10;
+	while( k-- ) v /= base;
+	v %= base;
+	return (v < 10) ? '0' + v : 'A' - 10 + v;
+}
+
+// applies the patches for memory mem to buf holding len bytes from adr,
+// verify only takes the unit's own bytes from the target instead
+void tgt_patch(uint8_t mem, uint32_t adr, uint8_t* buf, uint16_t len)
+{
+	uint8_t e;
+	for( e = 0; e < PATCH_N; ++e ) {
+		uint8_t* p = (uint8_t*)(EEDA_PATCH + e*PATCH_SIZE);
+		if( eeprom_read_byte(p) != mem ) continue;
+
+		uint8_t fmt = eeprom_read_byte(p+1);
+		uint8_t w = eeprom_read_byte(p+2);
+		uint32_t a = eeprom_read_dword((uint32_t*)(p+4));
+
+		uint8_t k;
+		for( k = 0; k < w; ++k ) {
+			if( (a+k < adr) || (a+k >= adr+len) ) continue;
+			uint8_t* d = buf + (a+k-adr);
+			if( !tgt_vonly ) {
+				*d = patch_byte(fmt, w, k);
+				tgt_patched = 1;
+			} else
+			if( mem == 'E' ) {
+				*d = isp_ee_rd(a+k);
+			} else {
+				isp_flash_rd(a+k, d, 1, 0);
+			}
+		}
+	}
+}
+
+void tgt_patch_begin(void)
+{
+	tgt_serial = eeprom_read_dword((uint32_t*)EEDA_SERIAL);
+	tgt_patched = 0;
+}
+
+// the serial was used, move on to the next one
+void tgt_patch_end(void)
+{
+	if( !tgt_patched ) return;
+
+	eeprom_update_dword((uint32_t*)EEDA_SERIAL_LAST, tgt_serial);
+	eeprom_update_dword((uint32_t*)EEDA_SERIAL, tgt_serial+1);
+}
+
+// --- programming state machine ----------------------------------------------
+//
+// A run is split into steps (one flash page, one EE byte, one fuse write) so
+// the main loop keeps serving AT commands between them.
+
+uint8_t tgt_start(uint8_t vonly)
+{
+	if( (tgt_phase != TGT_IDLE) || strm_on ) return 1;
+
+	tgt_slot = ee24_slot();
+	tgt_fwsize = eeprom_read_word((uint16_t*)PRM_ADR(tgt_slot, PRM_FW_SIZE));
+	tgt_eesize = eeprom_read_word((uint16_t*)PRM_ADR(tgt_slot, PRM_EE_SIZE));
+	tgt_eesrc = eeprom_read_word((uint16_t*)PRM_ADR(tgt_slot, PRM_EE_OFFS));
+	if( (tgt_fwsize > EE24_SLOT_SIZE) || (tgt_eesize && ((uint32_t)tgt_eesrc + tgt_eesize > EE24_SLOT_SIZE)) ) {
+		ser_puts_P(AT_CMD_UART, PSTR("ERR: Parameters exceed the slot\r\n"));
+		return 1;
+	}
+
+	ee24_up_flush(); // the page buffers take over rbuf, a failure is reported by the next command
+	arena_use(ARENA_PRG);
+
+	tgt_vonly = vonly;
+	tgt_traced = TGT_IDLE;
+	trace(TRC_RUN, vonly);
+	tgt_smart = (eeprom_read_byte((uint8_t*)EEDA_SMART) == 1);
+	tgt_vrf = tgt_vrf_mode();
+	tgt_patch_begin();
+
+	tgt_pgsize = eeprom_read_word((uint16_t*)EEWA_PG_SIZE);
+	img_map = 0xffff;
+	tgt_rcp = eeprom_read_word((uint16_t*)PRM_ADR(tgt_slot, PRM_RECIPE));
+	tgt_dst = 0;
+	tgt_srcoff = 0;
+	tgt_eedst = 0;
+	tgt_phase = TGT_CONNECT;
+
+	led_red(0); // both leds off
+	led_grn(0);
+	blink |= _BV(LEDR_BIT); // blink red
+	hnd_out(TGT_RUN);
+
+	return 0;
+}
+
+void tgt_end(uint8_t ec)
+{
+	isp_disconnect();
+	tgt_conn_load(); // the timing this run connected with, not the SCK of a recipe op
+	tgt_phase = TGT_IDLE;
+	tgt_result = ec;
+	trace(TRC_END, ec);
+	if( ec == 0 ) tgt_patch_end();
+	arena_use(ARENA_CMD);
+
+	blink = 0;
+	led_red(ec != 0);
+	led_grn(ec == 0);
+	hnd_out(ec);
+
+	ser_puti(AT_CMD_UART, ec, 10);
+	ser_endl(AT_CMD_UART);
+}
+
+void tgt_abort(void)
+{
+	// a fuse was being changed, put the old value back
+	if( (tgt_phase == TGT_FUSE) && tgt_retr && (isp_fuse_rd(tgt_pos) != tgt_oldf) ) {
+		isp_fuse_wr(tgt_pos, tgt_oldf);
+	}
+
+	ser_puts_P(AT_CMD_UART, PSTR("ERR: Aborted\r\n"));
+	tgt_end(7);
+}
+
+void tgt_flash_begin(void)
+{
+	ser_puts_P(AT_CMD_UART, tgt_vonly ? PSTR("Verifying flash...\r\n") : PSTR("Programming flash...\r\n"));
+	tgt_pg = pgbuf[0];
+	tgt_nx = pgbuf[1];
+	tgt_adr = tgt_dst;
+	tgt_img_rd(tgt_srcoff+tgt_adr, tgt_pg, tgt_pgsize);
+	tgt_phase = TGT_FLASH;
+}
+
+// the fixed order goes on with phase, a recipe with its next op
+void tgt_next(uint8_t phase)
+{
+	tgt_phase = (tgt_rcp != 0xffff) ? TGT_RCP : phase;
+	tgt_pos = 0;
+}
+
+// bytes of the current page that belong to the image
+uint16_t tgt_pglen(void)
+{
+	if( tgt_fwsize - tgt_adr < tgt_pgsize ) return tgt_fwsize - tgt_adr;
+	return tgt_pgsize;
+}
+
+// reads a page that failed verify back into tgt_nx to report the first differing byte
+void tgt_flash_diff(uint16_t len)
+{
+	isp_flash_rd(tgt_adr, tgt_nx, len, 0);
+
+	uint16_t i = 0;
+	while( (i < len - 1) && (tgt_nx[i] == tgt_pg[i]) ) ++i;
+
+	ser_puts_P(AT_CMD_UART, PSTR("ERR: Flash mismatch "));
+	ser_puti_lc(AT_CMD_UART, tgt_adr + i, 16, 6, '0');
+	ser_endl(AT_CMD_UART);
+}
+
+uint8_t tgt_step_flash(void)
+{
+	if( tgt_adr >= tgt_fwsize ) {
+		if( !tgt_vonly && (tgt_vrf == VRF_DEFERRED) ) {
+			ser_puts_P(AT_CMD_UART, PSTR("Verifying flash...\r\n"));
+			tgt_adr = tgt_dst;
+			tgt_phase = TGT_VRF;
+			return TGT_RUN;
+		}
+		tgt_next(TGT_EE);
+		return TGT_RUN;
+	}
+
+	ser_puti_lc(AT_CMD_UART, tgt_adr, 16, 6, '0');
+	ser_endl(AT_CMD_UART);
+
+	// verify only compares the image itself, not the rest of its last page
+	uint16_t len = tgt_vonly ? tgt_pglen() : tgt_pgsize;
+
+	tgt_patch('F', tgt_adr, tgt_pg, tgt_pgsize);
+
+	uint8_t wr = !tgt_vonly && !bufofval(tgt_pg, tgt_pgsize, 0xff); // write only non-empty pages
+	if( wr ) isp_flash_wr(tgt_adr, tgt_pg, tgt_pgsize);
+
+	uint8_t last = (tgt_adr + tgt_pgsize >= tgt_fwsize);
+
+	// fetch the next page while the target is busy writing
+	if( !last ) tgt_img_rd(tgt_srcoff+tgt_adr+tgt_pgsize, tgt_nx, tgt_pgsize);
+
+	uint8_t vrf = tgt_vonly;
+	if( wr && (tgt_vrf == VRF_INLINE) ) vrf = 1;
+	if( wr && (tgt_vrf == VRF_SAMPLED) && (last || (((tgt_adr / tgt_pgsize) & VRF_SAMPLE_MASK) == 0)) ) vrf = 1;
+
+	if( vrf ) {
+		uint8_t ok;
+		isp_flash_rd(tgt_adr, tgt_pg, len, &ok);
+		if( ok == 0 ) {
+			trace(TRC_VRF_ERR, tgt_adr >> 8);
+			if( tgt_vonly ) {
+				tgt_flash_diff(len); // the prefetched next page is lost, the run ends here
+			} else {
+				ser_puts_P(AT_CMD_UART, PSTR("ERR: Flash verify failed\r\n"));
+			}
+			return 4;
+		}
+	}
+
+	uint8_t* b = tgt_pg;
+	tgt_pg = tgt_nx;
+	tgt_nx = b;
+	tgt_adr += tgt_pgsize;
+
+	return TGT_RUN;
+}
+
+// compares one flash page with the image: the smart mode compare before erase
+// (image bytes only) and the deferred verify after writing (written pages only)
+uint8_t tgt_step_cmp(void)
+{
+	if( tgt_adr >= tgt_fwsize ) {
+		if( tgt_phase == TGT_CMP ) ser_puts_P(AT_CMD_UART, PSTR("Flash matches, skipped\r\n"));
+		tgt_next(TGT_EE);
+		return TGT_RUN;
+	}
+
+	uint16_t len = (tgt_phase == TGT_CMP) ? tgt_pglen() : tgt_pgsize;
+	uint8_t vrf = 1;
+	tgt_img_rd(tgt_srcoff+tgt_adr, pgbuf[0], len);
+	tgt_patch('F', tgt_adr, pgbuf[0], len);
+	if( (tgt_phase == TGT_CMP) || !bufofval(pgbuf[0], len, 0xff) ) {
+		isp_flash_rd(tgt_adr, pgbuf[0], len, &vrf);
+	}
+	if( vrf == 0 ) {
+		if( tgt_phase == TGT_CMP ) {
+			tgt_phase = TGT_ERASE;
+			return TGT_RUN;
+		}
+		trace(TRC_VRF_ERR, tgt_adr >> 8);
+		ser_puts_P(AT_CMD_UART, PSTR("ERR: Flash verify failed "));
+		ser_puti_lc(AT_CMD_UART, tgt_adr, 16, 6, '0');
+		ser_endl(AT_CMD_UART);
+		return 4;
+	}
+
+	tgt_adr += tgt_pgsize;
+	return TGT_RUN;
+}
+
+uint8_t tgt_step_ee(void)
+{
+	uint16_t i = tgt_pos;
+
+	if( i >= tgt_eesize ) {
+		tgt_next(TGT_FUSE);
+		tgt_retr = 0;
+		return TGT_RUN;
+	}
+
+	if( i == 0 ) ser_puts_P(AT_CMD_UART, tgt_vonly ? PSTR("Verifying EE...\r\n") : PSTR("Programming EE...\r\n"));
+
+	if( (i & 0x1f) == 0 ) { // load ee data in 32 byte chunks
+		tgt_img_rd(tgt_eesrc+i, pgbuf[0], 32);
+		tgt_patch('E', tgt_eedst+i, pgbuf[0], 32);
+		ser_puti_lc(AT_CMD_UART, tgt_eedst+i, 16, 4, '0');
+		ser_endl(AT_CMD_UART);
+	}
+
+	// EE page mode, one page (within the 32 byte chunk) per step
+	uint8_t pg = tgt_vonly ? 0 : isp_ee_pgsize();
+	if( pg ) {
+		uint16_t e = i;
+		uint8_t ld = 0;
+		do {
+			uint8_t d = pgbuf[0][e & 0x1f];
+			uint16_t a = tgt_eedst + e;
+			if( !(tgt_smart && (isp_ee_rd(a) == d)) ) {
+				isp_ee_pgld(a, d);
+				ld = 1;
+			}
+			++e;
+		} while( (e < tgt_eesize) && (e & 0x1f) && ((tgt_eedst + e) & (pg - 1)) );
+		if( ld ) isp_ee_pgwr(tgt_eedst + i);
+
+		if( tgt_vrf != VRF_OFF ) {
+			for( ; i < e; ++i ) {
+				if( isp_ee_rd(tgt_eedst + i) != pgbuf[0][i & 0x1f] ) {
+					ser_puts_P(AT_CMD_UART, PSTR("ERR: EE verify failed\r\n"));
+					return 5;
+				}
+			}
+		}
+
+		tgt_pos = e;
+		return TGT_RUN;
+	}
+
+	uint8_t d = pgbuf[0][i & 0x1f];
+	i += tgt_eedst;
+	if( !tgt_vonly && !(tgt_smart && (isp_ee_rd(i) == d)) ) isp_ee_wr(i, d); // smart mode writes only bytes that differ
+	if( (tgt_vonly || (tgt_vrf != VRF_OFF)) && (isp_ee_rd(i) != d) ) {
+		if( tgt_vonly ) {
+			ser_puts_P(AT_CMD_UART, PSTR("ERR: EE mismatch "));
+			ser_puti_lc(AT_CMD_UART, i, 16, 4, '0');
+			ser_endl(AT_CMD_UART);
+		} else {
+			ser_puts_P(AT_CMD_UART, PSTR("ERR: EE verify failed\r\n"));
+		}
+		return 5;
+	}
+
+	++tgt_pos;
+	return TGT_RUN;
+}
+
+// one fuse write attempt per step
+uint8_t tgt_step_fuse(void)
+{
+	uint8_t f = tgt_pos;
+
+	if( f >= 4 ) {
+		ser_puts_P(AT_CMD_UART, PSTR("Done.\r\n"));
+		return 0;
+	}
+
+	uint8_t d = tgt_fval;
+	if( tgt_rcp == 0xffff ) {
+		if( eeprom_read_byte((uint8_t*)PRM_ADR(tgt_slot, PRM_XFUSE_PRG+f)) != 1 ) {
+			++tgt_pos;
+			return TGT_RUN;
+		}
+		d = eeprom_read_byte((uint8_t*)PRM_ADR(tgt_slot, PRM_XFUSE+f));
+	}
+
+	if( tgt_vonly ) {
+		uint8_t c = isp_fuse_rd(f);
+		if( c != d ) {
+			ser_puts_P(AT_CMD_UART, PSTR("ERR: "));
+			ser_puts_P(AT_CMD_UART, fuse_name[f]);
+			ser_puts_P(AT_CMD_UART, PSTR(" mismatch "));
+			ser_puti_lc(AT_CMD_UART, c, 16, 2, '0');
 			ser_endl(AT_CMD_UART);
+			return 6;
+		}
+		++tgt_pos;
+		if( tgt_rcp != 0xffff ) tgt_phase = TGT_RCP;
+		return TGT_RUN;
+	}
+
+	if( tgt_retr == 0 ) {
+		ser_puts_P(AT_CMD_UART, PSTR("Setting "));
+		ser_puts_P(AT_CMD_UART, fuse_name[f]);
+		ser_puts_P(AT_CMD_UART, PSTR(" to "));
+		ser_puti_lc(AT_CMD_UART, d, 16, 2, '0');
+		ser_puts_P(AT_CMD_UART, PSTR("..."));
+
+		tgt_retr = 16;
+		tgt_oldf = isp_fuse_rd(f);
+	}
+
+	if( isp_fuse_rd(f) == d ) {
+		ser_puts_P(AT_CMD_UART, PSTR("OK\r\n"));
+		++tgt_pos;
+		tgt_retr = 0;
+		if( tgt_rcp != 0xffff ) tgt_phase = TGT_RCP;
+		return TGT_RUN;
+	}
+
+	if( --tgt_retr == 0 ) {
+		ser_puts_P(AT_CMD_UART, PSTR("FAIL\r\n"));
+		isp_fuse_wr(f, tgt_oldf); // attempt to set old fuse
+		return 6;
+	}
+	if( tgt_retr < 15 ) trace(TRC_FUSE_RETRY, f);
+	isp_fuse_wr(f, d);
+
+	return TGT_RUN;
+}
+
+// --- recipe interpreter ---
+//
+// A recipe is a list of ops in the slot next to the image (RCP_...). Each op
+// sets up one of the phases above, which comes back here when it is done.
+// The recipe and everything its ops read must lie inside the image the slot
+// was activated with, anything else is a bad op.
+
+uint16_t rcp_word(uint8_t* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+uint8_t tgt_step_rcp(void)
+{
+	uint8_t op[7];
+	uint16_t len = eeprom_read_word((uint16_t*)EEWA_SLOT_LEN+tgt_slot);
+	if( (tgt_rcp >= len) || tgt_img_rd(tgt_rcp, op, sizeof(op)) ) op[0] = 0xfe; // invalid
+
+	uint8_t n = 1;
+	switch( op[0] ) {
+		case RCP_END:
+		case 0xff:
+			ser_puts_P(AT_CMD_UART, PSTR("Done.\r\n"));
+			return 0;
+		case RCP_ERASE:
+			if( !tgt_vonly ) tgt_phase = TGT_ERASE;
+			break;
+		case RCP_FLASH:
+			n = 7;
+			tgt_dst = rcp_word(op+3);
+			if( (tgt_dst % tgt_pgsize) || (rcp_word(op+5) == 0) || ((uint32_t)rcp_word(op+1) + rcp_word(op+5) > len) ) {
+				op[0] = 0xfe;
+				break;
+			}
+			tgt_srcoff = rcp_word(op+1) - tgt_dst;
+			tgt_fwsize = tgt_dst + rcp_word(op+5);
+			tgt_flash_begin();
+			break;
+		case RCP_EE:
+			n = 7;
+			if( (rcp_word(op+5) == 0) || ((uint32_t)rcp_word(op+1) + rcp_word(op+5) > len) ) {
+				op[0] = 0xfe;
+				break;
+			}
+			tgt_eesrc = rcp_word(op+1);
+			tgt_eedst = rcp_word(op+3);
+			tgt_eesize = rcp_word(op+5);
+			tgt_pos = 0;
+			tgt_phase = TGT_EE;
+			break;
+		case RCP_FUSE:
+			n = 3;
+			tgt_pos = op[1] & 3;
+			tgt_fval = op[2];
+			tgt_retr = 0;
+			tgt_phase = TGT_FUSE;
+			break;
+		case RCP_VERIFY:
+			ser_puts_P(AT_CMD_UART, PSTR("Verifying flash...\r\n"));
+			tgt_adr = tgt_dst;
+			tgt_phase = TGT_VRF;
+			break;
+		case RCP_SCK:
+			n = 2;
+			isp_sck_set(op[1]);
+			break;
+		case RCP_RECONNECT: {
+			isp_disconnect();
+			uint8_t r = tgt_open(PGBUFSIZE);
+			if( r ) return r;
+			break;
+		}
+		default:
+			op[0] = 0xfe;
+	}
+	if( (uint32_t)tgt_rcp + n > len ) op[0] = 0xfe; // op cut off by the end of the image
 
-			ee24_rd(adr, atbuf, pgsize);
-			if( !bufofval(atbuf, pgsize, 0xff) ) { // write only non-empty pages
-				isp_flash_wr(adr, atbuf, pgsize);
-				uint8_t vrf;
-				isp_flash_rd(adr, atbuf, pgsize, &vrf);
-				if( vrf == 0 ) {
-					ser_puts_P(AT_CMD_UART, PSTR("ERR: Flash verify failed\r\n"));
-					return 4;
+	if( op[0] == 0xfe ) {
+		ser_puts_P(AT_CMD_UART, PSTR("ERR: Recipe op at "));
+		ser_puti_lc(AT_CMD_UART, tgt_rcp, 16, 4, '0');
+		ser_endl(AT_CMD_UART);
+		return 8;
+	}
+
+	tgt_rcp += n;
+	return TGT_RUN;
+}
+
+// returns TGT_RUN while the run is in progress, the result code after
+uint8_t tgt_step(void)
+{
+	wdt_reset();
+
+	if( tgt_phase != tgt_traced ) {
+		tgt_traced = tgt_phase;
+		trace(TRC_PHASE, tgt_phase);
+	}
+
+	switch( tgt_phase ) {
+		case TGT_CONNECT: {
+			uint8_t r = tgt_open(PGBUFSIZE);
+			if( r ) return r;
+			tgt_phase = TGT_EE;
+			tgt_pos = 0;
+			if( tgt_rcp != 0xffff ) {
+				tgt_phase = TGT_RCP;
+			} else
+			if( tgt_fwsize ) {
+				if( tgt_vonly ) {
+					tgt_flash_begin();
+				} else
+				if( tgt_smart ) {
+					ser_puts_P(AT_CMD_UART, PSTR("Comparing flash...\r\n"));
+					tgt_adr = 0;
+					tgt_phase = TGT_CMP;
+				} else {
+					tgt_phase = TGT_ERASE;
 				}
 			}
-			adr += pgsize;
+			break;
+		}
+		case TGT_CMP:
+		case TGT_VRF:
+			return tgt_step_cmp();
+		case TGT_ERASE:
+			ser_puts_P(AT_CMD_UART, PSTR("Erasing...\r\n"));
+			isp_chip_erase();
+			if( tgt_rcp != 0xffff ) {
+				tgt_phase = TGT_RCP;
+			} else {
+				tgt_flash_begin();
+			}
+			break;
+		case TGT_FLASH:
+			return tgt_step_flash();
+		case TGT_EE:
+			return tgt_step_ee();
+		case TGT_FUSE:
+			return tgt_step_fuse();
+		case TGT_RCP:
+			return tgt_step_rcp();
+	}
+
+	return TGT_RUN;
+}
+
+// progress of the current phase in percent
+uint8_t tgt_pct(void)
+{
+	switch( tgt_phase ) {
+		case TGT_CMP:
+		case TGT_VRF:
+		case TGT_FLASH: return tgt_adr * 100 / tgt_fwsize;
+		case TGT_EE: return tgt_eesize ? (uint32_t)tgt_pos * 100 / tgt_eesize : 0;
+		case TGT_FUSE: return tgt_pos * 25;
+	}
+	return 0;
+}
+
+void tgt_stat(void)
+{
+	ser_puts_P(AT_CMD_UART, PSTR("phase "));
+	ser_puts_P(AT_CMD_UART, phase_name[tgt_phase]);
+	ser_endl(AT_CMD_UART);
+
+	ser_puts_P(AT_CMD_UART, PSTR("pct "));
+	ser_puti(AT_CMD_UART, tgt_pct(), 10);
+	ser_endl(AT_CMD_UART);
+
+	if( (tgt_phase == TGT_IDLE) && (tgt_result != TGT_RUN) ) {
+		ser_puts_P(AT_CMD_UART, PSTR("result "));
+		ser_puti(AT_CMD_UART, tgt_result, 10);
+		ser_endl(AT_CMD_UART);
+	}
+}
+
+// --- streaming --------------------------------------------------------------
+//
+// Pages come straight from the host via AT+BUFWR and AT+ISPSTRPG. The page
+// is only started on the target, its verify is done when the next page (or
+// AT+ISPSTREND) arrives, so the target burns while the host is sending.
+
+uint8_t tgt_strm_begin(void)
+{
+	uint8_t r = tgt_open(BUFSIZE);
+	if( r == 0 ) {
+		isp_chip_erase();
+		tgt_vonly = 0;
+		tgt_patch_begin();
+		strm_on = 1;
+		strm_pend = 0;
+	} else {
+		isp_disconnect();
+	}
+	return r;
+}
+
+// verify the page started by the previous AT+ISPSTRPG, its data is in rbuf
+uint8_t tgt_strm_check(void)
+{
+	if( strm_pend ) {
+		strm_pend = 0;
+		uint8_t vrf;
+		isp_flash_rd(strm_adr, rbuf, rlen, &vrf);
+		if( vrf == 0 ) {
+			ser_puts_P(AT_CMD_UART, PSTR("ERR: Flash verify failed "));
+			ser_puti_lc(AT_CMD_UART, strm_adr, 16, 6, '0');
+			ser_endl(AT_CMD_UART);
+			strm_on = 0;
+			isp_disconnect();
+			return 1;
 		}
 	}
+	return 0;
+}
 
-	// program eeprom
-	uint16_t eesize = eeprom_read_word((uint16_t*)EEWA_EE_SIZE);
-	if( eesize ) {
-		ser_puts_P(AT_CMD_UART, PSTR("Programming EE...\r\n"));
-		uint16_t eeoffs = eeprom_read_word((uint16_t*)EEWA_EE_OFFS);
+uint8_t tgt_strm_page(uint32_t adr)
+{
+	if( tgt_strm_check() ) return 1;
 
-		uint16_t i;
-		for( i = 0; i < eesize; ++i ) {
-			wdt_reset();
-			if( (i & 0x1f) == 0 ) { // load ee data in 32 byte chunks
-				ee24_rd(eeoffs+i, atbuf, 32);
-				ser_puti_lc(AT_CMD_UART, i, 16, 4, '0');
-				ser_endl(AT_CMD_UART);
-			}
-			uint8_t d = atbuf[i & 0x1f];
-			isp_ee_wr(i, d);
-			if( isp_ee_rd(i) != d ) {
-				ser_puts_P(AT_CMD_UART, PSTR("ERR: EE verify failed\r\n"));
-				return 5;
-			}
-		}
-	}
+	tgt_patch('F', adr, wbuf, wlen);
 
-	// program fuses
-	uint8_t f;
-	for( f = 0; f < 4; ++f ) {
-		wdt_reset();
-		if( eeprom_read_byte((uint8_t*)(EEDA_XFUSE_PRG+f)) == 1 ) {
-
-			uint8_t d = eeprom_read_byte((uint8_t*)(EEDA_XFUSE+f));
-
-			ser_puts_P(AT_CMD_UART, PSTR("Setting "));
-			ser_puts(AT_CMD_UART, fuse_name[f]);
-			ser_puts_P(AT_CMD_UART, PSTR(" to "));
-			ser_puti_lc(AT_CMD_UART, d, 16, 2, '0');
-			ser_puts_P(AT_CMD_UART, PSTR("..."));
-
-			uint8_t retr = 16;
-			uint8_t oldf = isp_fuse_rd(f);
-			while( isp_fuse_rd(f) != d ) {
-				if( --retr == 0 ) {
-					ser_puts_P(AT_CMD_UART, PSTR("FAIL\r\n"));
-					isp_fuse_wr(f, oldf); // attempt to set old fuse
-					return 6;
-				}
-				isp_fuse_wr(f, d);
-			}
-			ser_puts_P(AT_CMD_UART, PSTR("OK\r\n"));
-		}
+	if( !bufofval(wbuf, wlen, 0xff) ) { // write only non-empty pages
+		isp_flash_wr(adr, wbuf, wlen);
+
+		// keep the page for verify, the host fills the other buffer meanwhile
+		uint8_t* b = rbuf;
+		rbuf = wbuf;
+		rlen = wlen;
+		wbuf = b;
+		wlen = 0;
+
+		strm_adr = adr;
+		strm_pend = 1;
 	}
 
-	ser_puts_P(AT_CMD_UART, PSTR("Done.\r\n"));
 	return 0;
 }
 
-uint8_t tgt_prog(void)
+uint8_t tgt_strm_end(void)
 {
-	uint8_t r = tgt_prog_try();
+	uint8_t r = tgt_strm_check();
+	strm_on = 0;
 	isp_disconnect();
+	if( r == 0 ) tgt_patch_end();
 	return r;
 }
 
+// drop the stream without verifying, the serial number is not advanced
+void tgt_strm_abort(void)
+{
+	strm_on = 0;
+	strm_pend = 0;
+	isp_disconnect();
+	ser_puts_P(AT_CMD_UART, PSTR("ERR: Aborted\r\n"));
+}
+
 //-----------------------------------------------------------------------------
 //  AT command processing
 //-----------------------------------------------------------------------------
@@ -416,6 +1582,14 @@ uint8_t proc_at_cmd(const char* s)
 {
 	if( s[0] == 0 ) return 1;
 
+	// a stream owns the target and both buffers until it ends or is aborted
+	if( strm_on && strncmp_P(s, atbufwr, strlen_P(atbufwr)) && strncmp_P(s, atispstrpg, strlen_P(atispstrpg)) &&
+	    strcmp_P(s, atispstrend) && strcmp_P(s, atispabort) ) return 1;
+
+	// the chunk of the last AT+EE24UP is still in rbuf, finish it before anything
+	// else can touch rbuf or the 24C512, AT+EE24UP checks it itself
+	if( strncmp_P(s, atee24up, strlen_P(atee24up)) && ee24_up_check() ) return 2;
+
 	if( 0 == strcmp_P(s, PSTR("AT")) ) {
 		return 0;
 	}
@@ -438,12 +1612,71 @@ uint8_t proc_at_cmd(const char* s)
 	if( 0 == strcmp_P(s, PSTR("AT$")) ) {
 		uint8_t i;
 		for( i = 0; i < (sizeof(atcommands)/sizeof(PGM_P)); ++i ) {
-			ser_puts_P(AT_CMD_UART, atcommands[i]);
+			ser_puts_P(AT_CMD_UART, (PGM_P)pgm_read_ptr(&atcommands[i]));
+			ser_endl(AT_CMD_UART);
+		}
+		return 0;
+	}
+
+#ifdef BENCH
+	if( 0 == strncmp_P(s, atbench, strlen_P(atbench)) ) {
+		s += strlen_P(atbench);
+
+		bench_sel = udtoi(s);
+		BENCH_PORT &= ~_BV(BENCH_BIT);
+
+		return 0;
+	}
+#endif
+
+// --- programming run --------------------------------------------------------
+
+	if( 0 == strcmp_P(s, atispstat) ) {
+		tgt_stat();
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, atispabort) ) {
+		if( strm_on ) {
+			tgt_strm_abort();
+			return 0;
+		}
+		if( tgt_phase == TGT_IDLE ) return 1;
+
+		tgt_abort();
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, attrace) ) {
+		// header: timer 0 clock and reload value, for py/trace.py
+		ser_puts_P(AT_CMD_UART, PSTR("trace "));
+		ser_puti(AT_CMD_UART, F_CPU / 1024, 10);
+		ser_putc(AT_CMD_UART, ' ');
+		ser_puti(AT_CMD_UART, TMR0_RELOAD, 10);
+		ser_endl(AT_CMD_UART);
+
+		uint8_t i, k;
+		for( i = 0; i < trace_len(); ++i ) {
+			uint8_t e[TRACE_ENTRY_SIZE];
+			trace_entry(i, e);
+			for( k = 0; k < TRACE_ENTRY_SIZE; ++k ) ser_puti_lc(AT_CMD_UART, e[k], 16, 2, '0');
 			ser_endl(AT_CMD_UART);
 		}
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, attraceclr) ) {
+		trace_clear();
+
 		return 0;
 	}
 
+	// the run owns the target and the arena
+	if( tgt_phase != TGT_IDLE ) return 1;
+
 // --- buffer commands --------------------------------------------------------
 
 	if( 0 == strncmp_P(s, atbufwr, strlen_P(atbufwr)) ) {
@@ -518,15 +1751,16 @@ uint8_t proc_at_cmd(const char* s)
 		if( strlen(s) < 8 ) return 1;
 		if( s[6] != ',' ) return 1;
 
-		uint16_t adr = uhtoi(s, 6);
+		uint32_t adr = uhtoi(s, 6);
 		s += 7;
 		uint16_t len = udtoi(s);
 
 		if( (len < 1) || (len > BUFSIZE) ) return 1;
+		if( adr + len > ee24_uplimit() ) return 1;
 
 		rlen = len;
 
-		ee24_rd(adr, rbuf, rlen);
+		ee24_rdblk(ee24_upbase()+adr, rbuf, rlen);
 
 		if( bufdisp ) hprintbuf(rbuf, rlen);
 
@@ -537,12 +1771,56 @@ uint8_t proc_at_cmd(const char* s)
 		s += strlen_P(atee24wr);
 
 		if( wlen == 0 ) return 1; // nothing to write
-		//if( wlen > 64 ) return 1; // EE page write supports up to 64 bytes
 		if( strlen(s) != 6 ) return 1;
 
-		uint16_t adr = uhtoi(s, 6);
+		uint32_t adr = uhtoi(s, 6);
+		if( ee24_up_bad(adr, wlen) ) return 1;
+
+		// EE page write supports up to 64 bytes, split along 64 byte boundaries
+		uint16_t i = 0;
+		while( i < wlen ) {
+			uint16_t a = ee24_upbase() + adr + i;
+			uint8_t n = 64 - (a & 63);
+			if( n > wlen - i ) n = wlen - i;
+			if( ee24_wr(a, wbuf+i, n) ) return 1;
+			i += n;
+		}
 
-		ee24_wr(adr, wbuf, wlen);
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atee24up, strlen_P(atee24up)) ) {
+		s += strlen_P(atee24up);
+
+		if( ee24_up_check() ) return 2;
+
+		if( strlen(s) < 9 ) return 1;
+		if( s[6] != ',' ) return 1;
+
+		uint32_t adr = uhtoi(s, 6);
+		s += 7;
+		uint16_t len = strlen(s);
+		if( len % 2 ) return 1;
+		len /= 2;
+		if( len > 64 ) return 1; // EE page write supports up to 64 bytes
+		if( ((ee24_upbase() + adr) % EE24_PAGE) + len > EE24_PAGE ) return 1; // one page write, it would wrap
+		if( ee24_up_bad(adr, len) ) return 1;
+
+		uint16_t i;
+		for( i = 0; i < len; ++i ) {
+			wbuf[i] = uhtoi(s, 2);
+			s += 2;
+		}
+
+		// commit from rbuf, wbuf is free for the next chunk
+		uint8_t* b = rbuf;
+		rbuf = wbuf;
+		rlen = len;
+		wbuf = b;
+		wlen = 0;
+
+		up_adr = ee24_upbase() + adr;
+		up_state = UP_COMMIT;
 
 		return 0;
 	}
@@ -553,8 +1831,9 @@ uint8_t proc_at_cmd(const char* s)
 		if( strlen(s) < 1 ) return 1;
 
 		uint32_t len = udtoi(s);
+		if( len > EE24_SLOT_SIZE ) return 1;
 
-		uint16_t crc = ee24_crc(0, len);
+		uint16_t crc = ee24_crc(!ee24_slot(), len);
 
 		ser_puti_lc(AT_CMD_UART, crc, 16, 4, '0');
 		ser_endl(AT_CMD_UART);
@@ -562,6 +1841,75 @@ uint8_t proc_at_cmd(const char* s)
 		return 0;
 	}
 
+	if( 0 == strncmp_P(s, atee24swap, strlen_P(atee24swap)) ) {
+		s += strlen_P(atee24swap);
+
+		char* c = strchr(s, ',');
+		if( (c == 0) || (strlen(c+1) != 4) ) return 1;
+
+		uint32_t len = udtoi(s);
+		if( (len < 1) || (len > EE24_SLOT_SIZE) ) return 1;
+
+		uint16_t crc = ee24_crc(!ee24_slot(), len);
+		if( crc != uhtoi(c+1, 4) ) {
+			ser_puts_P(AT_CMD_UART, PSTR("ERR: CRC "));
+			ser_puti_lc(AT_CMD_UART, crc, 16, 4, '0');
+			ser_endl(AT_CMD_UART);
+			return 2;
+		}
+
+		uint8_t n = !ee24_slot();
+		eeprom_update_word((uint16_t*)EEWA_SLOT_LEN+n, len);
+		eeprom_update_word((uint16_t*)EEWA_SLOT_CRC+n, crc);
+		prm_stage(n, 1);
+		eeprom_update_byte((uint8_t*)EEDA_SLOT, n); // single byte write, the switch is atomic
+		store_ok = 0;
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, atee24slot) ) {
+		uint8_t n;
+		for( n = 0; n < 2; ++n ) {
+			ser_putc(AT_CMD_UART, 'A' + n);
+			ser_puts_P(AT_CMD_UART, (n == ee24_slot()) ? PSTR(" active ") : PSTR(" upload "));
+			ser_puti(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_SLOT_LEN+n), 10);
+			ser_putc(AT_CMD_UART, ' ');
+			ser_puti_lc(AT_CMD_UART, eeprom_read_word((uint16_t*)EEWA_SLOT_CRC+n), 16, 4, '0');
+			ser_endl(AT_CMD_UART);
+		}
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atee24format, strlen_P(atee24format)) ) {
+		s += strlen_P(atee24format);
+
+		if( s[0] == '?' ) {
+			ser_puts_P(AT_CMD_UART, ee24_store() ? PSTR("store\r\n") : PSTR("plain\r\n"));
+			return 0;
+		}
+		if( (s[0] != '0' && s[0] != '1') || s[1] ) return 1;
+
+		// both slots are empty in the new format
+		if( s[0] == '1' ) {
+			uint8_t e[32];
+			memset(e, 0xff, sizeof(e));
+			uint16_t a;
+			for( a = 0; a < STORE_POOL; a += sizeof(e) ) {
+				wdt_reset();
+				if( ee24_wr(a, e, sizeof(e)) ) return 2;
+			}
+		}
+		eeprom_update_dword((uint32_t*)EEWA_SLOT_LEN, 0);
+		eeprom_update_dword((uint32_t*)EEWA_SLOT_CRC, 0);
+		eeprom_update_byte((uint8_t*)EEDA_STORE, s[0] - '0');
+		img_map = 0xffff;
+		store_ok = 0;
+
+		return 0;
+	}
+
 // --- AVR ISP commands -------------------------------------------------------
 
 	if( 0 == strncmp_P(s, atisptarget, strlen_P(atisptarget)) ) {
@@ -574,16 +1922,27 @@ uint8_t proc_at_cmd(const char* s)
 		// sig
 		if( strlen(s) < 6 ) return 1;
 		eeprom_update_dword((uint32_t*)EEDA_SIG, uhtoi(s, 6));
+		// new target, forget the connect timing of the old one
+		eeprom_update_byte((uint8_t*)EEDA_CONN_RST, 0);
+		eeprom_update_byte((uint8_t*)EEDA_CONN_SCK, 0xff);
+		tgt_conn_load();
 		// pg size
 		s = strchr(s, ',');
 		if( s == 0 ) return 0;
 		s += 1;
-		eeprom_update_word((uint16_t*)EEWA_PG_SIZE, udtoi(s));
+		uint16_t pgsize = udtoi(s); // - or 0 takes it from the device database
+		struct isp_dev dev;
+		if( pgsize == 0 ) {
+			if( !isp_dev_find(eeprom_read_dword((uint32_t*)EEDA_SIG), &dev) ) return 1;
+			pgsize = dev.pgwords * 2;
+		}
+		eeprom_update_word((uint16_t*)EEWA_PG_SIZE, pgsize);
 		// fw size
 		s = strchr(s, ',');
 		if( s == 0 ) return 0;
 		s += 1;
 		uint16_t fwsize = udtoi(s);
+		if( fwsize > EE24_SLOT_SIZE ) return 1;
 		eeprom_update_word((uint16_t*)EEWA_FW_SIZE, fwsize);
 		// lfuse, hfuse, efuse, lock
 		uint8_t f;
@@ -602,14 +1961,18 @@ uint8_t proc_at_cmd(const char* s)
 		s = strchr(s, ',');
 		if( s == 0 ) return 0;
 		s += 1;
-		eeprom_update_word((uint16_t*)EEWA_EE_SIZE, udtoi(s));
-		eeprom_update_word((uint16_t*)EEWA_EE_OFFS, fwsize); // default offset = fwsize
-		// ee offset
+		uint16_t eesize = udtoi(s);
 		s = strchr(s, ',');
-		if( s == 0 ) return 0;
-		s += 1;
-		if( strlen(s) < 4 ) return 1;
-		eeprom_update_word((uint16_t*)EEWA_EE_OFFS, uhtoi(s, 4));
+		// the eeprom image must fit in the slot too, by default it follows the firmware
+		uint16_t eeoffs = fwsize;
+		if( s ) {
+			s += 1;
+			if( strlen(s) < 4 ) return 1;
+			eeoffs = uhtoi(s, 4);
+		}
+		if( eesize && ((uint32_t)eeoffs + eesize > EE24_SLOT_SIZE) ) return 1;
+		eeprom_update_word((uint16_t*)EEWA_EE_SIZE, eesize);
+		eeprom_update_word((uint16_t*)EEWA_EE_OFFS, eeoffs);
 
 		return 0;
 	}
@@ -617,6 +1980,8 @@ uint8_t proc_at_cmd(const char* s)
 	if( 0 == strncmp_P(s, atispcon, strlen_P(atispcon)) ) {
 
 		if( isp_connect() ) return 0;
+		tgt_conn_load();
+		return 1;
 	}
 
 	if( 0 == strncmp_P(s, atispdis, strlen_P(atispdis)) ) {
@@ -676,7 +2041,7 @@ uint8_t proc_at_cmd(const char* s)
 	if( 0 == strncmp_P(s, atispfuserd, strlen_P(atispfuserd)) ) {
 		uint8_t i;
 		for( i = 0; i < 4; ++i ) {
-			ser_puts(AT_CMD_UART, fuse_name[i]);
+			ser_puts_P(AT_CMD_UART, fuse_name[i]);
 			ser_putc(AT_CMD_UART, ' ');
 			ser_puti_lc(AT_CMD_UART, isp_fuse_rd(i), 16, 2, '0');
 			ser_endl(AT_CMD_UART);
@@ -743,8 +2108,203 @@ uint8_t proc_at_cmd(const char* s)
 	}
 #endif
 	if( 0 == strncmp_P(s, atispprogram, strlen_P(atispprogram)) ) {
-		ser_puti(AT_CMD_UART, tgt_prog(), 10);
-		ser_endl(AT_CMD_UART);
+		if( tgt_start(0) ) return 1;
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, atispverify) ) {
+		if( tgt_start(1) ) return 1;
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atispsmart, strlen_P(atispsmart)) ) {
+		s += strlen_P(atispsmart);
+		if( strlen(s) != 1 ) return 1;
+
+		if( s[0] == '?' ) {
+			ser_putc(AT_CMD_UART, (eeprom_read_byte((uint8_t*)EEDA_SMART) == 1) ? '1' : '0');
+			ser_endl(AT_CMD_UART);
+			return 0;
+		}
+		if( (s[0] != '0') && (s[0] != '1') ) return 1;
+
+		eeprom_update_byte((uint8_t*)EEDA_SMART, s[0] - '0');
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atispserial, strlen_P(atispserial)) ) {
+		s += strlen_P(atispserial);
+		if( strlen(s) < 1 ) return 1;
+
+		if( 0 == strcmp_P(s, PSTR("?")) ) {
+			ser_puts_P(AT_CMD_UART, PSTR("next "));
+			ser_puti(AT_CMD_UART, eeprom_read_dword((uint32_t*)EEDA_SERIAL), 10);
+			ser_endl(AT_CMD_UART);
+			ser_puts_P(AT_CMD_UART, PSTR("last "));
+			ser_puti(AT_CMD_UART, eeprom_read_dword((uint32_t*)EEDA_SERIAL_LAST), 10);
+			ser_endl(AT_CMD_UART);
+			return 0;
+		}
+
+		eeprom_update_dword((uint32_t*)EEDA_SERIAL, udtoi(s));
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atisppatch, strlen_P(atisppatch)) ) {
+		s += strlen_P(atisppatch);
+
+		if( 0 == strcmp_P(s, PSTR("?")) ) {
+			uint8_t e;
+			for( e = 0; e < PATCH_N; ++e ) {
+				uint8_t* p = (uint8_t*)(EEDA_PATCH + e*PATCH_SIZE);
+				uint8_t m = eeprom_read_byte(p);
+				if( (m != 'F') && (m != 'E') ) continue;
+				ser_putc(AT_CMD_UART, '0'+e);
+				ser_putc(AT_CMD_UART, ',');
+				ser_putc(AT_CMD_UART, m);
+				ser_putc(AT_CMD_UART, ',');
+				ser_putc(AT_CMD_UART, eeprom_read_byte(p+1));
+				ser_putc(AT_CMD_UART, ',');
+				ser_puti(AT_CMD_UART, eeprom_read_byte(p+2), 10);
+				ser_putc(AT_CMD_UART, ',');
+				ser_puti_lc(AT_CMD_UART, eeprom_read_dword((uint32_t*)(p+4)), 16, 6, '0');
+				ser_endl(AT_CMD_UART);
+			}
+			return 0;
+		}
+
+		if( strlen(s) < 3 ) return 1;
+		if( (s[0] < '0') || (s[0] >= '0'+PATCH_N) || (s[1] != ',') ) return 1;
+		uint8_t* p = (uint8_t*)(EEDA_PATCH + (s[0]-'0')*PATCH_SIZE);
+		s += 2;
+
+		if( 0 == strcmp_P(s, PSTR("-")) ) { // remove
+			eeprom_update_byte(p, 0xff);
+			return 0;
+		}
+
+		if( strlen(s) < 12 ) return 1;
+		if( (s[0] != 'F') && (s[0] != 'E') ) return 1;
+		if( (s[2] != 'L') && (s[2] != 'B') && (s[2] != 'D') && (s[2] != 'H') ) return 1;
+		if( (s[1] != ',') || (s[3] != ',') ) return 1;
+		uint8_t w = udtoi(s+4);
+		if( (w < 1) || (w > 10) ) return 1;
+		char* a = strchr(s+4, ',');
+		if( (a == 0) || (strlen(a+1) != 6) ) return 1;
+
+		eeprom_update_byte(p+1, s[2]);
+		eeprom_update_byte(p+2, w);
+		eeprom_update_dword((uint32_t*)(p+4), uhtoi(a+1, 6));
+		eeprom_update_byte(p, s[0]);
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atispsck, strlen_P(atispsck)) ) {
+		s += strlen_P(atispsck);
+		if( strlen(s) != 1 ) return 1;
+
+		if( s[0] == '?' ) {
+			ser_puts_P(AT_CMD_UART, PSTR("sck "));
+			ser_puti(AT_CMD_UART, isp_conn_sck(), 10);
+			ser_endl(AT_CMD_UART);
+			ser_puts_P(AT_CMD_UART, PSTR("rst "));
+			ser_puti(AT_CMD_UART, isp_conn_rst_ms(), 10);
+			ser_endl(AT_CMD_UART);
+			ser_puts_P(AT_CMD_UART, PSTR("attempts "));
+			ser_puti(AT_CMD_UART, isp_conn_tries(), 10);
+			ser_endl(AT_CMD_UART);
+			return 0;
+		}
+		if( (s[0] < '0') || (s[0] >= '0' + ISP_SCK_N) ) return 1;
+
+		eeprom_update_byte((uint8_t*)EEDA_CONN_SCK, s[0] - '0');
+		eeprom_update_byte((uint8_t*)EEDA_CONN_RST, 0); // default
+		tgt_conn_load();
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atisphandler, strlen_P(atisphandler)) ) {
+		s += strlen_P(atisphandler);
+		if( strlen(s) != 1 ) return 1;
+
+		if( s[0] == '?' ) {
+			ser_puts_P(AT_CMD_UART, PSTR("handler "));
+			ser_puti(AT_CMD_UART, hnd_mode, 10);
+			ser_endl(AT_CMD_UART);
+			return 0;
+		}
+		if( (s[0] < '0') || (s[0] > '2') ) return 1;
+
+		eeprom_update_byte((uint8_t*)EEDA_HANDLER, s[0] - '0');
+		hnd_init();
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atispvrf, strlen_P(atispvrf)) ) {
+		s += strlen_P(atispvrf);
+		if( strlen(s) != 1 ) return 1;
+
+		if( s[0] == '?' ) {
+			ser_putc(AT_CMD_UART, '0' + tgt_vrf_mode());
+			ser_endl(AT_CMD_UART);
+			return 0;
+		}
+		if( (s[0] < '0') || (s[0] > '0' + VRF_SAMPLED) ) return 1;
+
+		eeprom_update_byte((uint8_t*)EEDA_VRF, s[0] - '0');
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atisprecipe, strlen_P(atisprecipe)) ) {
+		s += strlen_P(atisprecipe);
+
+		if( s[0] == '-' ) {
+			eeprom_update_word((uint16_t*)EEWA_RECIPE, 0xffff);
+			return 0;
+		}
+		if( strlen(s) != 4 ) return 1;
+		uint16_t a = uhtoi(s, 4);
+		if( a >= EE24_SLOT_SIZE ) return 1;
+
+		eeprom_update_word((uint16_t*)EEWA_RECIPE, a);
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, atispstrbeg) ) {
+		if( strm_on ) return 1;
+
+		if( tgt_strm_begin() ) return 1;
+
+		return 0;
+	}
+
+	if( 0 == strncmp_P(s, atispstrpg, strlen_P(atispstrpg)) ) {
+		s += strlen_P(atispstrpg);
+
+		if( !strm_on ) return 1;
+		if( wlen != eeprom_read_word((uint16_t*)EEWA_PG_SIZE) ) return 1; // whole pages only
+		if( strlen(s) != 6 ) return 1;
+
+		uint32_t adr = uhtoi(s, 6);
+
+		if( tgt_strm_page(adr) ) return 1;
+
+		return 0;
+	}
+
+	if( 0 == strcmp_P(s, atispstrend) ) {
+		if( !strm_on ) return 1;
+
+		if( tgt_strm_end() ) return 1;
 
 		return 0;
 	}
@@ -761,10 +2321,18 @@ int main(void)
 	wdt_reset();
 	wdt_enable(WDTO_2S);
 
+	arena_use(ARENA_CMD);
+
+#ifdef BENCH
+	DDR(BENCH_PORT) |= _BV(BENCH_BIT);
+#endif
+
 	ser_init(AT_CMD_UART, AT_CMD_BAUD, txbuf, sizeof(txbuf), rxbuf, sizeof(rxbuf));
 	ee24_init(I2C_100K);
 	isp_init();
+	tgt_conn_load();
 	btn_init();
+	hnd_init();
 	tmr0_init();
 
 	sei();
@@ -775,44 +2343,85 @@ int main(void)
 		eeprom_update_word((uint16_t*)EEWA_PG_SIZE, 0);
 		eeprom_update_word((uint16_t*)EEWA_FW_SIZE, 0);
 		eeprom_update_word((uint16_t*)EEWA_EE_SIZE, 0);
+		eeprom_update_dword((uint32_t*)EEDA_SERIAL, 1);
+		eeprom_update_dword((uint32_t*)EEDA_SERIAL_LAST, 0);
+		eeprom_update_byte((uint8_t*)EEDA_SLOT, 0);
+		eeprom_update_dword((uint32_t*)EEWA_SLOT_LEN, 0);
+		eeprom_update_dword((uint32_t*)EEWA_SLOT_CRC, 0);
+		eeprom_update_byte((uint8_t*)EEDA_STORE, 0);
+	}
+	if( eeprom_read_dword((uint32_t*)EEDA_SERIAL) == 0xffffffff ) { // upgraded from a version without serials
+		eeprom_update_dword((uint32_t*)EEDA_SERIAL, 1);
+		eeprom_update_dword((uint32_t*)EEDA_SERIAL_LAST, 0);
 	}
+	if( eeprom_read_word((uint16_t*)PRM_ADR(0, PRM_FW_SIZE)) == 0xffff ) { // upgraded from global parameters
+		prm_stage(0, 1);
+		prm_stage(1, 1);
+	}
+
+	uint8_t btn_prev = 0;
+	uint8_t btn_held = 0;
 
 	while( 1 ) {
 		wdt_reset();
 
+		// write the last AT+EE24UP chunk while its successor is received
+		if( (up_state == UP_COMMIT) && (atbuflen == 0) ) ee24_up_commit();
+
+		// handler start, no parameter dump so the target is connected right away
+		if( hnd_start ) {
+			hnd_start = 0;
+			if( tgt_phase != TGT_IDLE ) {
+				trace(TRC_HND, 0); // BUSY is up for the run in progress
+			} else if( strm_on || tgt_start(hnd_mode == 2) ) {
+				trace(TRC_HND, 0);
+				hnd_out(1); // the ISR raised BUSY, refused is a fail
+			}
+		}
+
 		// btn processing
-		if( btn_pressed ) {
+		// a short press programs when released, holding it verifies
+		uint8_t btn_run = 0;
+		if( btn_long && !btn_held ) {
+			btn_held = 1;
+			btn_run = 2;
+		}
+		if( !btn_pressed && btn_prev && !btn_held ) btn_run = 1;
+		if( !btn_pressed ) btn_held = 0;
+		btn_prev = btn_pressed;
+
+		if( btn_run && (tgt_phase == TGT_IDLE) && !strm_on ) {
 			ser_puts_P(AT_CMD_UART, PSTR("Parameters:\r\n"));
-			led_red(0); // both leds off
-			led_grn(0);
-			blink |= _BV(LEDR_BIT); // blink red
 			tgt_info();
-			uint8_t ec = tgt_prog();
-			blink = 0;
-			led_red(ec != 0);
-			led_grn(ec == 0);
-			while( btn_pressed ) {
-				wdt_reset();
-				_delay_ms(200);
-			}
+			tgt_start(btn_run == 2);
+		}
+
+		// programming run
+		if( tgt_phase != TGT_IDLE ) {
+			uint8_t ec = tgt_step();
+			if( ec != TGT_RUN ) tgt_end(ec);
 		}
 
 		// at command processing
 		uint8_t d;
 		if( ser_getc(AT_CMD_UART, &d) ) {
+			BENCH_BEGIN(BENCH_AT_CHAR);
 
 			// echo character
 			if( at_echo ) { ser_putc(AT_CMD_UART, d); }
 
 			// buffer overflow guard
-			if( atbuflen >= sizeof(atbuf) ) { atbuflen = 0; }
+			if( atbuflen >= atbufsize ) { atbuflen = 0; }
 
 			// execute on enter
 			if( (d == '\r') || (d == '\n') ) {
 				if( atbuflen ) {
 					atbuf[atbuflen] = 0;
 					atbuflen = 0;
+					BENCH_END(BENCH_AT_CHAR);
+					BENCH_BEGIN(BENCH_AT_CMD);
 					uint8_t r = proc_at_cmd((char*)atbuf);
+					BENCH_END(BENCH_AT_CMD);
 					if( r == 0 ) ser_puts_P(AT_CMD_UART, PSTR("OK\r\n"));
 					if( r == 1 ) ser_puts_P(AT_CMD_UART, PSTR("ERR\r\n"));
 				}
@@ -821,7 +2430,10 @@ int main(void)
 				if( atbuflen ) { --atbuflen; }
 			} else {			// store character
 				atbuf[atbuflen++] = toupper(d);
+				if( atbuflen >= ATBUFSIZE - STORE_REFSIZE ) store_ok = 0; // the terminator lands there too
 			}
+
+			BENCH_END(BENCH_AT_CHAR);
 		}
 	}
 }
@@ -832,7 +2444,15 @@ int main(void)
 
 ISR(TIMER0_OVF_vect) // should overflow approx 64 times per sec
 {
-	TCNT0 = 0x100 - (F_CPU / 0x10000);
+	TCNT0 = TMR0_RELOAD;
+	++trace_ovf;
+
+#if TMR0_OVFS > 1
+	static uint8_t ovf_cnt = 0;
+
+	if( ++ovf_cnt < TMR0_OVFS ) return;
+	ovf_cnt = 0;
+#endif
 
 	// LED blink processing
 	static uint8_t blink_cnt = 0;
@@ -847,12 +2467,45 @@ ISR(TIMER0_OVF_vect) // should overflow approx 64 times per sec
 	static uint8_t btn_cnt = 0;
 
 	if( (PIN(BTN_PORT) & _BV(BTN_BIT)) == 0 ) {
-		if( ++btn_cnt >= BTN_THRE ) {
-			btn_cnt = BTN_THRE;
-			btn_pressed = 1;
+		if( btn_cnt < BTN_LONG ) {
+			++btn_cnt;
+			if( btn_cnt == BTN_THRE ) trace(TRC_BTN, 1);
+			if( btn_cnt == BTN_LONG ) trace(TRC_BTN, 2);
 		}
+		if( btn_cnt >= BTN_THRE ) btn_pressed = 1;
+		if( btn_cnt >= BTN_LONG ) btn_long = 1;
 	} else {
+		if( btn_pressed ) trace(TRC_BTN, 0);
 		btn_cnt = 0;
 		btn_pressed = 0;
+		btn_long = 0;
+	}
+
+	// handler start input rearm
+	static uint8_t hnd_cnt = 0;
+
+	if( hnd_mode && !(HND_INT_MASK & _BV(INT0)) ) {
+		if( PIN(HND_PORT) & _BV(HND_START_BIT) ) {
+			if( ++hnd_cnt >= HND_REARM ) {
+				hnd_cnt = 0;
+				HND_INT_FLAGS = _BV(INTF0); // edges while disarmed
+				HND_INT_MASK |= _BV(INT0);
+				trace(TRC_HND, 2);
+			}
+		} else {
+			hnd_cnt = 0;
+		}
 	}
 }
+
+ISR(INT0_vect)
+{
+	if( PIN(HND_PORT) & _BV(HND_START_BIT) ) return; // a glitch, already gone
+
+	HND_INT_MASK &= ~_BV(INT0); // until released
+	hnd_start = 1;
+	trace(TRC_HND, 1);
+
+	// the run starts on the next main loop pass, show the handler it was seen
+	if( tgt_phase == TGT_IDLE ) HND_PORT = (HND_PORT & ~HND_OUTS) | _BV(HND_BUSY_BIT);
+}
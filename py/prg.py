@@ -1,6 +1,77 @@
 #!/usr/bin/python3
 
-import sys,serial,time,crcmod
+import sys,serial,time,crcmod,zlib
+
+# per command round trip times, collected with -p
+class Prof:
+  def __init__(self):
+    self.recs = [] # [start, cmd, latency, tx bytes, rx lines, result, time lost in timeouts]
+    self.cur = None
+    self.retries = 0
+    self.payload = 0
+    self.t0 = time.time()
+    self.tp = None # first payload byte sent
+    self.tp1 = None
+
+  def begin(self, cmnd):
+    self.end()
+    self.cur = [time.time(), cmnd.split('=')[0], 0.0, len(cmnd) + 1, 0, 'OK', 0.0]
+
+  def line(self, l, t, to):
+    if self.cur is None: return
+    self.cur[4] += 1
+    if not l.endswith('\n') and t >= to: self.cur[6] += t # nothing (complete) arrived in time
+    self.cur[2] = time.time() - self.cur[0]
+    r = l.strip()
+    if r in ('OK', 'ERR') or r == '': self.cur[5] = r if r else 'TIMEOUT'
+
+  def end(self):
+    if self.cur is not None: self.recs.append(self.cur)
+    self.cur = None
+
+  def data(self, n):
+    if self.tp is None: self.tp = time.time()
+    self.payload += n
+    self.tp1 = time.time()
+
+  def report(self, csvname):
+    self.end()
+    if csvname:
+      with open(csvname, 'w') as f:
+        f.write('t,cmd,latency_ms,tx_bytes,rx_lines,result,timeout_ms\n')
+        for r in self.recs:
+          f.write('{:.4f},{},{:.2f},{},{},{},{:.2f}\n'.format(r[0]-self.t0, r[1], r[2]*1000, r[3], r[4], r[5], r[6]*1000))
+    print()
+    print('{:<16}{:>6}{:>9}{:>9}{:>9}{:>9}{:>10}'.format('command','n','min ms','med ms','p90 ms','max ms','total s'))
+    cmds = sorted(set(r[1] for r in self.recs), key = lambda c: -sum(r[2] for r in self.recs if r[1] == c))
+    for c in cmds:
+      l = sorted(r[2]*1000 for r in self.recs if r[1] == c)
+      print('{:<16}{:>6}{:>9.1f}{:>9.1f}{:>9.1f}{:>9.1f}{:>10.2f}'.format(c, len(l), l[0], l[len(l)//2], l[len(l)*9//10], l[-1], sum(l)/1000))
+    print()
+    print('latency histogram (all commands)')
+    b = {}
+    for r in self.recs:
+      k = 0
+      while (1 << k) < r[2]*1000: k += 1
+      b[k] = b.get(k, 0) + 1
+    if b:
+      m = max(b.values())
+      for k in range(min(b), max(b)+1):
+        print('{:>8} ms {:>6} {}'.format('<=' + str(1 << k), b.get(k, 0), '#' * (b.get(k, 0) * 50 // m)))
+    print()
+    tt = time.time() - self.t0
+    to = sum(r[6] for r in self.recs)
+    print('total {:.2f} s, in commands {:.2f} s, lost in timeouts {:.2f} s, retries {}'.format(tt, sum(r[2] for r in self.recs), to, self.retries))
+    if self.payload and self.tp1 > self.tp:
+      print('payload {} bytes in {:.2f} s, {:.0f} bytes/s'.format(self.payload, self.tp1 - self.tp, self.payload / (self.tp1 - self.tp)))
+
+prof = None
+
+def readline(to):
+  t = time.time()
+  l = ser.readline().decode('ascii')
+  if prof: prof.line(l, time.time() - t, to)
+  return l.rstrip()
 
 #def atcmd(cmnd, resp, to):
 #  print(cmnd)
@@ -10,55 +81,229 @@ def atcmd(cmnd, resp, to = 0.5):
   if ser.timeout != to:
     ser.timeout = to
   ser.flushInput()
+  if prof: prof.begin(cmnd)
   ser.write((cmnd + '\n').encode('ascii'))
-  r = ser.readline().decode('ascii').rstrip();
+  r = readline(to)
   if len(resp) > 0 and r.find(resp) == -1:
     if r == '': r = '(none)'
     raise RuntimeError('Error! expected ' + resp + '\ncmnd was: ' + cmnd + '\nresp was: ' + r + '\n')
   return r
 
-if len(sys.argv) < 3:
-  print('usage: prg.py serial_if filename')
+# read a multi line response up to the final OK
+def atlines(cmnd, to = 0.5):
+  r = [atcmd(cmnd, '', to)]
+  while r[-1] != 'OK':
+    if r[-1] == '' or r[-1] == 'ERR':
+      raise RuntimeError('Error! expected OK\ncmnd was: ' + cmnd + '\nresp was: ' + ' / '.join(r) + '\n')
+    r.append(readline(to))
+  return r[:-1]
+
+def atinfo(cmnd, to = 0.5):
+  r = {}
+  for l in atlines(cmnd, to):
+    k = l.split(' ')
+    r[k[0]] = k[-1]
+  return r
+
+# the programmer refuses commands while a programming run is in progress,
+# uploads go to the inactive slot so just try again a bit later
+def busy_retry(f, n = 60):
+  while True:
+    try:
+      return f()
+    except RuntimeError:
+      n -= 1
+      if n == 0: raise
+      if prof: prof.retries += 1
+      time.sleep(1) # a run reads commands slowly, don't flood it
+
+# the programmer writes a chunk while the next one is sent and reads it back
+# when the next one arrives, returns the address to continue from
+def upload_chunk(addr, d):
+  r = atcmd('AT+EE24UP={:06x},{}'.format(addr, d.hex()), '')
+  if r.startswith('ERR: EE24 verify failed'):
+    return int(r.split(' ')[-1], 16) # send the previous chunk again
+  if r != 'OK':
+    raise RuntimeError('Error! expected OK\ncmnd was: AT+EE24UP={:06x}\nresp was: {}\n'.format(addr, r))
+  return addr + len(d)
+
+# chunks is a list of (address, data), data up to 64 bytes within a 128 byte
+# 24C512 page
+def upload(chunks):
+  i = 0
+  fails = {}
+  while i < len(chunks):
+    addr, d = chunks[i]
+    print(i,'/',len(chunks))
+    a = busy_retry(lambda: upload_chunk(addr, d))
+    if a == addr + len(d):
+      if prof: prof.data(len(d))
+      i += 1
+    else:
+      fails[a] = fails.get(a, 0) + 1
+      if fails[a] > 3:
+        raise RuntimeError('Error! 24C512 verify keeps failing at {:06x}\n'.format(a))
+      i = [c[0] for c in chunks].index(a)
+
+def device_crc():
+  return atlines('AT+EE24CRC={}'.format(len(b)), 20)[-1]
+
+def ee24_read(addr, n):
+  busy_retry(lambda: atcmd('AT+EE24RD={:06x},{}'.format(addr, n), 'OK'))
+  return bytes.fromhex(busy_retry(lambda: atlines('AT+BUFRD'))[0])
+
+# block store, see AT+EE24FORMAT in the README
+STORE_BLK = 128
+STORE_MAP = (0x0000, 0x0200)
+STORE_IDX = 0x0400
+STORE_POOL = 0x0c00 // STORE_BLK
+STORE_NBLK = 0x10000 // STORE_BLK
+
+def blk_hash(d):
+  return zlib.crc32(d).to_bytes(4, 'little')
+
+# Uploads only the blocks the store doesn't hold yet and the map of the
+# upload slot. Blocks of the active slot are never written. With reuse off
+# every block is written again, in case the index doesn't match the blocks.
+def store_chunks(b, reuse):
+  slots = [l.split(' ') for l in busy_retry(lambda: atlines('AT+EE24SLOT'))]
+  act = 0 if slots[0][1] == 'active' else 1
+  mlen = (int(slots[act][2]) + STORE_BLK - 1) // STORE_BLK * 2
+  amap = b''
+  for a in range(0, mlen, 128):
+    amap += ee24_read(STORE_MAP[act] + a, min(128, mlen - a))
+  live = set(int.from_bytes(amap[i:i+2], 'little') for i in range(0, len(amap), 2))
+  live = set(n for n in live if STORE_POOL <= n < STORE_NBLK)
+
+  # hashes of the live blocks, read from the index 32 at a time
+  have = {}
+  if reuse:
+    for k in sorted(set(n // 32 for n in live)):
+      idx = ee24_read(STORE_IDX + k * 128, 128)
+      for n in live:
+        if n // 32 == k: have[idx[(n % 32) * 4:(n % 32) * 4 + 4]] = n
+
+  free = [n for n in range(STORE_POOL, STORE_NBLK) if n not in live]
+  chunks = []
+  bmap = b''
+  for a in range(0, len(b), STORE_BLK):
+    d = b[a:a+STORE_BLK]
+    d += b'\xff' * (STORE_BLK - len(d))
+    if d == b'\xff' * STORE_BLK:
+      n = 0xffff
+    elif blk_hash(d) in have:
+      n = have[blk_hash(d)]
+    else:
+      if not free: raise RuntimeError('Block store full, AT+EE24FORMAT=1 to start over.')
+      n = free.pop(0)
+      have[blk_hash(d)] = n
+      chunks += [(n * STORE_BLK, d[:64]), (n * STORE_BLK + 64, d[64:])]
+      chunks.append((STORE_IDX + n * 4, blk_hash(d)))
+    bmap += n.to_bytes(2, 'little')
+  print('new blocks:', len(chunks) // 3, 'of', (len(b) + STORE_BLK - 1) // STORE_BLK)
+  for a in range(0, len(bmap), 64):
+    chunks.append((STORE_MAP[1 - act] + a, bmap[a:a+64]))
+  return chunks
+
+# program the target directly, bypassing the 24C512
+def stream(b):
+  pgsize = int(atinfo('AT+ISPTARGET=?')['pgsize'])
+  # flash bytes the programmer patches with the serial number, e,F,fmt,width,aaaaaa
+  patched = set()
+  for l in atlines('AT+ISPPATCH=?'):
+    p = l.split(',')
+    if p[1] == 'F': patched.update(range(int(p[4], 16), int(p[4], 16) + int(p[3])))
+  atlines('AT+ISPSTRBEG', 5)
+  try:
+    addr = 0
+    while addr < len(b):
+      pg = b[addr:addr+pgsize]
+      pg += b'\xff' * (pgsize - len(pg))
+      print(addr,'/',len(b))
+      # empty pages are already erased, unless a patch goes there
+      if pg != b'\xff' * pgsize or patched.intersection(range(addr, addr+pgsize)):
+        atcmd('AT+BUFWR={}'.format(pg.hex()), 'OK')
+        atlines('AT+ISPSTRPG={:06x}'.format(addr))
+      if prof: prof.data(min(pgsize, len(b)-addr))
+      addr += pgsize
+  except:
+    atcmd('AT+ISPSTREND', '') # release the target
+    raise
+  atlines('AT+ISPSTREND') # verifies the last page
+
+args = [a for a in sys.argv[1:] if not a.startswith('-')]
+opts = [a for a in sys.argv[1:] if a.startswith('-')]
+
+if len(args) < 2:
+  print('usage: prg.py [-s] [-n] [-bBAUD] [-p[CSV]] serial_if filename')
+  print('  -s      stream straight to the target instead of the 24C512')
+  print('  -n      upload only, keep programming from the current 24C512 slot')
+  print('  -bBAUD  programmer baud rate (4800, i.e. 1 MHz build)')
+  print('  -p[CSV] print command latency statistics, optionally save every command to CSV')
   exit(1)
 
-f = open(sys.argv[2], 'rb')
+baud = 4800
+csvname = None
+for o in opts:
+  if o.startswith('-b'): baud = int(o[2:])
+  if o.startswith('-p'):
+    prof = Prof()
+    csvname = o[2:]
+
+f = open(args[1], 'rb')
 b = f.read()
 f.close()
 print('text size:',len(b))
 xmodem_crc_func = crcmod.mkCrcFun(0x11021, rev=False, initCrc=0x0000, xorOut=0x0000)
 bcrc = xmodem_crc_func(b)
 
-ser = serial.Serial(sys.argv[1], 4800)
+ser = serial.Serial(args[0], baud)
 try:
   retries = 5
   while retries:
     try:
       retries -= 1
-      atcmd('AT+BUFRDDISP=0', 'OK')
-      break
+      r = atcmd('AT+BUFRDDISP=0', '')
+      while r not in ('OK', 'ERR', ''): r = readline(0.5) # progress lines of a run
+      if r == 'OK': break
+      if r == 'ERR': # busy programming, answers again when the run is over
+        retries += 1
+        time.sleep(0.5)
+      elif prof: prof.retries += 1
     except:
-      pass
+      if prof: prof.retries += 1
   if retries == 0:
     print('avr isp bub not responding')
     exit(1)
 
-  addr = 0
+  if '-s' in opts:
+    stream(b)
+    print('Done.')
+    exit(0)
+
+  store = busy_retry(lambda: atlines('AT+EE24FORMAT=?'))[0] == 'store'
 
-  while addr < len(b):
-    nb = min(64, len(b)-addr)
-    s = b[addr:addr+nb].hex()
-    print(addr,'/',len(b))
-    atcmd('AT+BUFWR={}'.format(s), 'OK')
-    atcmd('AT+EE24WR={:06x}'.format(addr), 'OK')
-    atcmd('AT+EE24RD={:06x},{}'.format(addr,nb), 'OK')
-    atcmd('AT+BUFCMP', 'OK')
-    addr += nb
+  if store:
+    upload(store_chunks(b, True))
+  else:
+    upload([(a, b[a:a+64]) for a in range(0, len(b), 64)])
 
-  dcrc = atcmd('AT+EE24CRC={}'.format(len(b)), '', 20)
+  dcrc = busy_retry(device_crc)
+  if store and int(dcrc, 16) != bcrc:
+    print('CRC mismatch, uploading all blocks again.')
+    upload(store_chunks(b, False))
+    dcrc = busy_retry(device_crc)
   print('Device CRC:',dcrc)
   print('File CRC  :',hex(bcrc)[2:])
+  if int(dcrc, 16) != bcrc:
+    print('CRC mismatch, slot not switched.')
+    exit(1)
+  if '-n' not in opts:
+    busy_retry(lambda: atcmd('AT+EE24SWAP={},{:04x}'.format(len(b), bcrc), 'OK', 20))
+    print('Slot switched.')
   print('Done.')
 except Exception as e:
   print(str(e))
 finally:
+  if prof: prof.report(csvname)
   ser.close()
@@ -0,0 +1,60 @@
+#!/usr/bin/python3
+
+# Compiles a programming recipe and appends it to the image, e.g.
+#
+#   # fuses first so the rest runs on the fast clock
+#   fuse lfuse e4
+#   reconnect
+#   sck 1
+#   erase
+#   flash 0 0 1c00       # src dst len, hex
+#   flash 1c00 7000 400
+#   verify               # the last flash region
+#   ee 2000 0 80
+#   fuse lock fc
+#
+# then upload the output with prg.py and issue the printed AT+ISPRECIPE.
+
+import sys
+
+FUSES = {'lfuse':0, 'hfuse':1, 'efuse':2, 'lock':3}
+
+def word(x):
+  x = int(x, 16)
+  if x > 0xffff: raise ValueError('{:x} does not fit a word'.format(x))
+  return bytes([x & 0xff, x >> 8])
+
+def rcp_compile(lines):
+  r = b''
+  for n, l in enumerate(lines, 1):
+    k = l.split('#')[0].split()
+    if not k: continue
+    try:
+      op = k[0].lower()
+      if op in ('flash', 'ee') and len(k) == 4 and int(k[3], 16) == 0: raise ValueError('empty region')
+      if op == 'erase' and len(k) == 1: r += b'\x01'
+      elif op == 'flash' and len(k) == 4: r += b'\x02' + word(k[1]) + word(k[2]) + word(k[3])
+      elif op == 'ee' and len(k) == 4: r += b'\x03' + word(k[1]) + word(k[2]) + word(k[3])
+      elif op == 'fuse' and len(k) == 3: r += bytes([4, FUSES[k[1].lower()], int(k[2], 16)])
+      elif op == 'verify' and len(k) == 1: r += b'\x05'
+      elif op == 'sck' and len(k) == 2 and 0 <= int(k[1]) <= 6: r += bytes([6, int(k[1])])
+      elif op == 'reconnect' and len(k) == 1: r += b'\x07'
+      else: raise ValueError('unknown op')
+    except (ValueError, KeyError) as e:
+      raise RuntimeError('line {}: {} ({})'.format(n, l.strip(), e))
+  return r + b'\x00'
+
+if len(sys.argv) < 4:
+  print('usage: recipe.py image recipe output')
+  exit(1)
+
+try:
+  b = open(sys.argv[1], 'rb').read()
+  r = rcp_compile(open(sys.argv[2]).readlines())
+except Exception as e:
+  print(str(e))
+  exit(1)
+
+open(sys.argv[3], 'wb').write(b + r)
+print('recipe {} bytes'.format(len(r)))
+print('AT+ISPRECIPE={:04x}'.format(len(b)))
@@ -0,0 +1,86 @@
+#!/usr/bin/python3
+
+# Reads the event trace of the programmer (AT+TRACE) and prints it with
+# times in ms. Also takes a saved AT+TRACE dump instead of a serial port.
+
+import sys,os
+
+PHASES = {0:'idle', 1:'connect', 2:'erase', 3:'flash', 4:'ee', 5:'fuse', 6:'compare', 7:'verify', 8:'recipe'}
+FUSES = ['lfuse', 'hfuse', 'efuse', 'lock']
+
+def ev_btn(a): return 'button ' + {0:'released', 1:'pressed', 2:'held'}.get(a, str(a))
+def ev_run(a): return 'verify run' if a else 'program run'
+def ev_phase(a): return 'phase ' + PHASES.get(a, str(a))
+def ev_end(a): return 'end, result {}'.format(a)
+def ev_conn(a): return 'connected after {} attempts'.format(a) if a else 'connect failed'
+def ev_slow(a): return 'reset cycled, SCK F_CPU/{}'.format(2 << a)
+def ev_fuse(a): return 'retry ' + FUSES[a & 3]
+def ev_ee24(a): return '24C512 read error at {:04x}'.format(a << 8)
+def ev_vrf(a): return 'flash verify failed at {:06x}'.format(a << 8)
+def ev_hnd(a): return 'handler ' + {0:'start ignored, busy', 1:'start', 2:'start rearmed'}.get(a, str(a))
+
+EVENTS = {1:ev_btn, 2:ev_run, 3:ev_phase, 4:ev_end, 5:ev_conn, 6:ev_slow, 7:ev_fuse, 8:ev_ee24, 9:ev_vrf, 10:ev_hnd}
+
+def read_port(port, baud):
+  import serial
+  ser = serial.Serial(port, baud, timeout = 1)
+  ser.flushInput()
+  ser.write(b'AT+TRACE\n')
+  r = []
+  while True:
+    l = ser.readline().decode('ascii').strip()
+    if l == '': raise RuntimeError('programmer not responding')
+    if l == 'ERR': raise RuntimeError('AT+TRACE failed')
+    if l == 'OK': break
+    r.append(l)
+  ser.close()
+  return r
+
+def decode(lines):
+  hdr = [l for l in lines if l.startswith('trace ')]
+  if not hdr: raise RuntimeError('no trace header')
+  clk, reload = [int(x) for x in hdr[-1].split(' ')[1:3]]
+  period = 0x100 - reload # timer counts per overflow
+  wrap = 0x10000 * period * 1000.0 / clk
+  t0 = None
+  tp = None
+  off = 0
+  for l in lines[lines.index(hdr[-1])+1:]:
+    if len(l) != 10: continue
+    e = bytes.fromhex(l)
+    ovf = e[0] + (e[1] << 8)
+    cnt = e[2]
+    if cnt < reload: # overflow was pending when the event was stamped
+      ovf += 1
+    else:
+      cnt -= reload
+    t = (ovf * period + cnt) * 1000.0 / clk + off
+    if tp is not None and t < tp: # overflow counter wrapped
+      off += wrap
+      t += wrap
+    if t0 is None: t0 = tp = t
+    f = EVENTS.get(e[3])
+    print('{:>10.1f} {:>+8.1f}  {}'.format(t - t0, t - tp, f(e[4]) if f else 'event {} {}'.format(e[3], e[4])))
+    tp = t
+
+args = [a for a in sys.argv[1:] if not a.startswith('-')]
+opts = [a for a in sys.argv[1:] if a.startswith('-')]
+
+if len(args) < 1:
+  print('usage: trace.py [-bBAUD] serial_if|dumpfile')
+  print('  -bBAUD  programmer baud rate (4800, i.e. 1 MHz build)')
+  exit(1)
+
+baud = 4800
+for o in opts:
+  if o.startswith('-b'): baud = int(o[2:])
+
+try:
+  if os.path.isfile(args[0]):
+    lines = [l.strip() for l in open(args[0])]
+  else:
+    lines = read_port(args[0], baud)
+  print('{:>10} {:>8}  {}'.format('ms', 'delta', 'event'))
+  decode(lines)
+except Exception as e:
+  print(str(e))
@@ -0,0 +1,61 @@
+/**
+AVR isp bub
+
+@file		trace.c
+@author		Matej Kogovsek
+@copyright	GPL v2
+*/
+
+#include <inttypes.h>
+#include <string.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "trace.h"
+
+volatile uint16_t trace_ovf = 0;
+
+#if TRACE_N
+
+static uint8_t trace_buf[TRACE_N][TRACE_ENTRY_SIZE];
+static uint8_t trace_pos = 0; // next entry to write
+static uint8_t trace_cnt = 0;
+
+// also called from the timer ISR
+void trace(uint8_t id, uint8_t arg)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t* e = trace_buf[trace_pos];
+		e[2] = TCNT0; // read first, an overflow pending in TOV0 shows as a count below the reload value
+		e[0] = trace_ovf;
+		e[1] = trace_ovf >> 8;
+		e[3] = id;
+		e[4] = arg;
+		if( ++trace_pos == TRACE_N ) trace_pos = 0;
+		if( trace_cnt < TRACE_N ) ++trace_cnt;
+	}
+}
+
+void trace_clear(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		trace_pos = 0;
+		trace_cnt = 0;
+	}
+}
+
+uint8_t trace_len(void)
+{
+	return trace_cnt;
+}
+
+// i-th oldest entry
+void trace_entry(uint8_t i, uint8_t* e)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t k = (trace_pos + TRACE_N - trace_cnt + i) % TRACE_N;
+		memcpy(e, trace_buf[k], TRACE_ENTRY_SIZE);
+	}
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef MAT_TRACE_H
+#define MAT_TRACE_H
+
+#include <inttypes.h>
+
+// Event trace, a ring of the last TRACE_N events. Each entry is stamped with
+// the timer 0 overflow count and TCNT0, py/trace.py turns these into ms.
+
+#define TRC_BTN 1 // 0 released, 1 pressed, 2 held
+#define TRC_RUN 2 // 0 program, 1 verify
+#define TRC_PHASE 3 // TGT_...
+#define TRC_END 4 // result code
+#define TRC_CONN 5 // programming enable attempts, 0 failed
+#define TRC_CONN_SLOW 6 // SCK rung after a failed reset cycle
+#define TRC_FUSE_RETRY 7 // fuse
+#define TRC_EE24_ERR 8 // 24C512 address >> 8
+#define TRC_VRF_ERR 9 // flash address >> 8
+#define TRC_HND 10 // 1 start edge, 0 ignored (busy), 2 rearmed
+
+// 1 KB parts have no RAM to spare for it, build with -DTRACE_N=16 to get it back
+#ifndef TRACE_N
+	#if RAMEND >= 0x8FF
+		#define TRACE_N 64
+	#else
+		#define TRACE_N 0
+	#endif
+#endif
+
+#define TRACE_ENTRY_SIZE 5 // overflows (word), TCNT0, id, arg
+
+extern volatile uint16_t trace_ovf; // advanced by the timer 0 ISR
+
+#if TRACE_N
+void trace(uint8_t id, uint8_t arg);
+void trace_clear(void);
+uint8_t trace_len(void);
+void trace_entry(uint8_t i, uint8_t* e);
+#else
+static inline void trace(uint8_t id, uint8_t arg) { (void)id; (void)arg; }
+static inline void trace_clear(void) {}
+static inline uint8_t trace_len(void) { return 0; }
+static inline void trace_entry(uint8_t i, uint8_t* e) { (void)i; (void)e; }
+#endif
+
+#endif